@@ -0,0 +1,364 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "em100.h"
+
+/* Trace Capture File Format
+ * =========================
+ *
+ * A capture file holds the raw SPI trace reports as they come from the
+ * EM100Pro, so decoding can happen offline. All values are little endian.
+ *
+ * File header:
+ *  0x0000000: 45 4d 31 30 30 54 52 43     - magic "EM100TRC" (8 bytes)
+ *  0x0000008: 01 00                       - version          (2 bytes)
+ *  0x000000a: 20 00                       - header size      (2 bytes)
+ *  0x000000c: 00 20 00 00                 - report length    (4 bytes)
+ *  0x0000010: start time, ns since epoch                     (8 bytes)
+ *  0x0000018: serial number                                  (4 bytes)
+ *  0x000001c: hardware version, 3 bytes reserved             (4 bytes)
+ *
+ * The header is followed by blocks, each starting with
+ *  0x00: block type                                          (1 byte)
+ *  0x01: reserved                                            (1 byte)
+ *  0x02: payload length                                      (2 bytes)
+ *  0x04: host time, ns since start of capture                (8 bytes)
+ *  0x0c: payload
+ *
+ * Block types:
+ *  0x01: SPI trace report. Only the valid part of the report is stored:
+ *        2 bytes (BE) number of records, then records of 8 bytes each.
+ *
+ * Readers skip block types they don't know.
+ */
+
+#define CAPTURE_MAGIC		"EM100TRC"
+#define CAPTURE_VERSION		1
+#define CAPTURE_HEADER_SIZE	0x20
+#define CAPTURE_BLOCK_HEADER_SIZE	0x0c
+
+#define CAPTURE_WRITE_BUFFER	(1 MB)
+
+static void put_le16(unsigned char *out, uint16_t val)
+{
+	out[0] = val&0xff;
+	out[1] = (val>>8)&0xff;
+}
+
+static void put_le32(unsigned char *out, uint32_t val)
+{
+	out[0] = val&0xff;
+	out[1] = (val>>8)&0xff;
+	out[2] = (val>>16)&0xff;
+	out[3] = (val>>24)&0xff;
+}
+
+static void put_le64(unsigned char *out, uint64_t val)
+{
+	put_le32(out, val & 0xffffffff);
+	put_le32(out + 4, val >> 32);
+}
+
+static uint16_t get_le16(const unsigned char *in)
+{
+	return (in[1] << 8) | in[0];
+}
+
+static uint32_t get_le32(const unsigned char *in)
+{
+	return ((uint32_t)in[3] << 24) | (in[2] << 16) | (in[1] << 8) | in[0];
+}
+
+static uint64_t get_le64(const unsigned char *in)
+{
+	return (uint64_t)get_le32(in + 4) << 32 | get_le32(in);
+}
+
+static uint64_t get_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * capture_clock: host time as used for capture blocks
+ */
+uint64_t capture_clock(void)
+{
+	return get_ns(CLOCK_MONOTONIC);
+}
+
+/**
+ * capture_create: start a new trace capture file
+ * @param filename: file to write
+ * @param em100:    device the trace is captured from
+ */
+struct trace_capture *capture_create(const char *filename,
+		struct em100 *em100)
+{
+	unsigned char header[CAPTURE_HEADER_SIZE];
+	struct trace_capture *capture;
+
+	capture = calloc(1, sizeof(*capture));
+	if (!capture) {
+		printf("Out of memory.\n");
+		return NULL;
+	}
+
+	capture->file = fopen(filename, "wb");
+	if (!capture->file) {
+		perror(filename);
+		free(capture);
+		return NULL;
+	}
+	setvbuf(capture->file, NULL, _IOFBF, CAPTURE_WRITE_BUFFER);
+
+	capture->start = capture_clock();
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, CAPTURE_MAGIC, 8);
+	put_le16(header + 0x08, CAPTURE_VERSION);
+	put_le16(header + 0x0a, CAPTURE_HEADER_SIZE);
+	put_le32(header + 0x0c, REPORT_BUFFER_LENGTH);
+	put_le64(header + 0x10, get_ns(CLOCK_REALTIME));
+	put_le32(header + 0x18, em100->serialno);
+	header[0x1c] = em100->hwversion;
+
+	if (fwrite(header, sizeof(header), 1, capture->file) != 1) {
+		perror(filename);
+		fclose(capture->file);
+		free(capture);
+		return NULL;
+	}
+
+	return capture;
+}
+
+static int capture_write_block(struct trace_capture *capture, uint8_t type,
+		uint64_t time, const unsigned char *data, uint16_t length)
+{
+	unsigned char header[CAPTURE_BLOCK_HEADER_SIZE];
+
+	header[0] = type;
+	header[1] = 0;
+	put_le16(header + 2, length);
+	put_le64(header + 4, time);
+
+	if (fwrite(header, sizeof(header), 1, capture->file) != 1 ||
+			fwrite(data, length, 1, capture->file) != 1) {
+		perror("Could not write trace capture");
+		return 0;
+	}
+
+	capture->blocks++;
+	capture->bytes += sizeof(header) + length;
+	return 1;
+}
+
+/**
+ * capture_write_reports: append SPI trace reports to a capture
+ * @param capture:    capture file
+ * @param time:       capture_clock() when the reports were received
+ * @param reportdata: reports as returned by the EM100Pro
+ * @param count:      number of reports
+ */
+int capture_write_reports(struct trace_capture *capture, uint64_t time,
+		unsigned char *reportdata, unsigned int count)
+{
+	unsigned char clamped[REPORT_BUFFER_LENGTH];
+	unsigned int report, records;
+
+	time -= capture->start;
+
+	for (report = 0; report < count; report++) {
+		unsigned char *data = reportdata + report * REPORT_BUFFER_LENGTH;
+
+		records = (data[0] << 8) | data[1];
+		if (records > REPORT_MAX_RECORDS) {
+			/* Store the clamped count, the block would
+			 * otherwise look damaged when read back. */
+			records = REPORT_MAX_RECORDS;
+			memcpy(clamped, data, 2 + records *
+					REPORT_RECORD_LENGTH);
+			clamped[0] = records >> 8;
+			clamped[1] = records & 0xff;
+			data = clamped;
+		}
+		if (!capture_write_block(capture, CAPTURE_BLOCK_TRACE, time,
+				data, 2 + records * REPORT_RECORD_LENGTH))
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * capture_open: open a trace capture file for reading
+ * @param filename: file to read
+ */
+struct trace_capture *capture_open(const char *filename)
+{
+	unsigned char header[CAPTURE_HEADER_SIZE];
+	struct trace_capture *capture;
+	unsigned int header_size;
+
+	capture = calloc(1, sizeof(*capture));
+	if (!capture) {
+		printf("Out of memory.\n");
+		return NULL;
+	}
+
+	capture->file = fopen(filename, "rb");
+	if (!capture->file) {
+		perror(filename);
+		free(capture);
+		return NULL;
+	}
+	setvbuf(capture->file, NULL, _IOFBF, CAPTURE_WRITE_BUFFER);
+
+	if (fread(header, sizeof(header), 1, capture->file) != 1 ||
+			memcmp(header, CAPTURE_MAGIC, 8)) {
+		printf("%s is not a trace capture.\n", filename);
+		goto error;
+	}
+
+	if (get_le16(header + 0x08) != CAPTURE_VERSION) {
+		printf("%s: unsupported capture version %d.\n", filename,
+				get_le16(header + 0x08));
+		goto error;
+	}
+
+	/* Newer versions may have a bigger header */
+	header_size = get_le16(header + 0x0a);
+	if (header_size < CAPTURE_HEADER_SIZE ||
+			fseeko(capture->file, header_size, SEEK_SET)) {
+		printf("%s: bad header size.\n", filename);
+		goto error;
+	}
+
+	capture->report_length = get_le32(header + 0x0c);
+	capture->realtime = get_le64(header + 0x10);
+	capture->serialno = get_le32(header + 0x18);
+	capture->hwversion = header[0x1c];
+
+	/* A block payload can't be longer than this */
+	capture->buffer = malloc(0x10000);
+	if (!capture->buffer) {
+		printf("Out of memory.\n");
+		goto error;
+	}
+
+	return capture;
+
+error:
+	fclose(capture->file);
+	free(capture);
+	return NULL;
+}
+
+/**
+ * capture_read_block: read the next block of a capture
+ * @param capture: capture opened with capture_open()
+ * @param block:   filled in; data stays valid until the next call
+ *
+ * Returns 1 if a block was read, 0 at the end of the capture and -1 if
+ * the capture is damaged. A truncated last block counts as the end, as
+ * that's what an interrupted capture looks like.
+ */
+int capture_read_block(struct trace_capture *capture,
+		struct capture_block *block)
+{
+	unsigned char header[CAPTURE_BLOCK_HEADER_SIZE];
+	off_t offset = ftello(capture->file);
+	unsigned int records;
+
+	if (offset < 0) {
+		perror("Could not read trace capture");
+		return -1;
+	}
+
+	if (fread(header, sizeof(header), 1, capture->file) != 1)
+		return ferror(capture->file) ? -1 : 0;
+
+	block->type = header[0];
+	block->length = get_le16(header + 2);
+	block->time = get_le64(header + 4);
+	block->offset = offset;
+	block->data = capture->buffer;
+
+	if (block->length && fread(capture->buffer, block->length, 1,
+			capture->file) != 1)
+		return ferror(capture->file) ? -1 : 0;
+
+	if (block->type != CAPTURE_BLOCK_TRACE)
+		return 1;
+
+	/* the writer never stores more than REPORT_MAX_RECORDS */
+	records = block->length < 2 ? 0 :
+			block->data[0] << 8 | block->data[1];
+	if (block->length < 2 || records > REPORT_MAX_RECORDS ||
+			block->length < 2 + records * REPORT_RECORD_LENGTH) {
+		printf("Damaged trace report at offset 0x%llx.\n",
+				(unsigned long long)offset);
+		return -1;
+	}
+
+	return 1;
+}
+
+/**
+ * capture_seek: continue reading at a block
+ * @param capture: capture opened with capture_open()
+ * @param offset:  offset of a block header, as reported in capture_block
+ */
+int capture_seek(struct trace_capture *capture, uint64_t offset)
+{
+	if (fseeko(capture->file, offset, SEEK_SET)) {
+		perror("Could not seek in trace capture");
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * capture_close: finish a trace capture
+ * @param capture: capture file
+ */
+int capture_close(struct trace_capture *capture)
+{
+	int ok = !fclose(capture->file);
+
+	if (capture->buffer) {
+		/* opened for reading */
+		free(capture->buffer);
+		free(capture);
+		return 1;
+	}
+
+	if (!ok)
+		perror("Could not write trace capture");
+	else
+		printf("Captured %llu reports (%llu bytes).\n",
+				(unsigned long long)capture->blocks,
+				(unsigned long long)capture->bytes);
+	free(capture);
+	return ok;
+}
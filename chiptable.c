@@ -0,0 +1,546 @@
+/*
+ * Copyright 2012-2015 Google Inc.
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "em100.h"
+
+/* Chip Table Format
+ * =================
+ *
+ * Listing the supported chips or identifying the emulated one used to
+ * parse every dediprog config in configs.tar.xz. Instead, all configs
+ * are compiled once into $EM100_HOME/chips.bin, which is rebuilt when
+ * size, mtime or CRC64 of the archive change. Values are in host byte
+ * order; the table never leaves the machine.
+ *
+ *  0x00: 45 4d 31 30 30 43 48 50  - magic "EM100CHP"     (8 bytes)
+ *  0x08: version                                         (4 bytes)
+ *  0x0c: number of chips                                 (4 bytes)
+ *  0x10: size of the archive                             (8 bytes)
+ *  0x18: mtime of the archive                            (8 bytes)
+ *  0x20: CRC64 of the archive                            (8 bytes)
+ *  0x28: offset and size of the string pool              (8 bytes)
+ *  0x30: offset and number of init entries               (8 bytes)
+ *  0x38: database version, in the string pool            (4 bytes)
+ *  0x3c: offset and number of ID index entries           (8 bytes)
+ *  0x44: reserved                                        (4 bytes)
+ *  0x48: struct chip_entry for each chip, by file name
+ *
+ * The ID index maps VENDID << 16 | DEVID, as set in the FPGA by the init
+ * sequence, to the chips using them. It is sorted by ID, so all chips
+ * sharing an ID are next to each other. The string pool holds NUL
+ * terminated file, vendor and chip names. The init sequences of all
+ * chips follow each other in one array of 4 byte entries, as sent to
+ * the FPGA.
+ */
+
+#define CHIP_TABLE_MAGIC	"EM100CHP"
+#define CHIP_TABLE_VERSION	2
+
+#define CONFIGS_PREFIX		"configs/"
+#define CONFIGS_SUFFIX		".cfg"
+
+struct chip_table_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint64_t archive_size;
+	uint64_t archive_mtime;
+	uint64_t archive_crc;
+	uint32_t strings;
+	uint32_t strings_size;
+	uint32_t init;
+	uint32_t init_count;
+	uint32_t db_version;
+	uint32_t ids;
+	uint32_t ids_count;
+	uint32_t reserved;
+};
+
+struct table_builder {
+	struct chip_entry *entries;
+	size_t count, entries_size;
+	char *strings;
+	size_t strings_len, strings_size;
+	uint8_t (*init)[BYTES_PER_INIT_ENTRY];
+	size_t init_count, init_size;
+	uint32_t db_version;
+	int failed;
+};
+
+/**
+ * Searches for a specific FPGA register in the chip initialisation
+ * sequence and returns the value in out.
+ *
+ * @reg1: e.g. FPGA write command (0x23)
+ * @reg2: e.g. FPGA register
+ *
+ * Returns 0 on success.
+ */
+static int get_chip_init_val(const chipdesc *desc,
+			     const uint8_t reg1,
+			     const uint8_t reg2,
+			     uint16_t *out)
+{
+	int i;
+
+	for (i = 0; i < desc->init_len; i++) {
+		if (desc->init[i][0] == reg1 && desc->init[i][1] == reg2) {
+			*out = (desc->init[i][2] << 8) | desc->init[i][3];
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Make room for need elements, doubling the array */
+static int grow(void *array, size_t *size, size_t need, size_t elem)
+{
+	size_t new_size = *size ? *size : 64;
+	void *p;
+
+	if (need <= *size)
+		return 1;
+	while (new_size < need)
+		new_size *= 2;
+
+	p = realloc(*(void **)array, new_size * elem);
+	if (!p)
+		return 0;
+	*(void **)array = p;
+	*size = new_size;
+	return 1;
+}
+
+static int add_string(struct table_builder *b, const char *s, size_t len,
+		uint32_t *offset)
+{
+	if (!grow(&b->strings, &b->strings_size, b->strings_len + len + 1, 1))
+		return 0;
+
+	*offset = b->strings_len;
+	memcpy(b->strings + b->strings_len, s, len);
+	b->strings[b->strings_len + len] = '\0';
+	b->strings_len += len + 1;
+	return 1;
+}
+
+/* There are a few dozen vendors for hundreds of chips */
+static int add_vendor(struct table_builder *b, const char *vendor,
+		uint32_t *offset)
+{
+	size_t i;
+
+	for (i = 0; i < b->count; i++) {
+		if (!strcmp(b->strings + b->entries[i].vendor, vendor)) {
+			*offset = b->entries[i].vendor;
+			return 1;
+		}
+	}
+	return add_string(b, vendor, strlen(vendor), offset);
+}
+
+static int add_config(char *name, TFILE *file, void *data, int ok)
+{
+	struct table_builder *b = data;
+	size_t len = strlen(name);
+	size_t prefix = strlen(CONFIGS_PREFIX), suffix = strlen(CONFIGS_SUFFIX);
+	struct chip_entry *entry;
+	uint16_t venid, devid;
+	chipdesc chip;
+
+	if (!ok)
+		return 0;
+
+	if (!strcmp(name, CONFIGS_PREFIX "VERSION")) {
+		if (!add_string(b, (const char *)file->address,
+				strnlen((const char *)file->address,
+					file->length), &b->db_version))
+			goto oom;
+		return 0;
+	}
+
+	/* Only configs/<chip>.cfg can be selected with --set */
+	if (len <= prefix + suffix || strncmp(name, CONFIGS_PREFIX, prefix) ||
+			strcmp(name + len - suffix, CONFIGS_SUFFIX))
+		return 0;
+
+	if (parse_dcfg(&chip, file))
+		return 0;
+
+	if (!grow(&b->entries, &b->entries_size, b->count + 1,
+				sizeof(*b->entries)) ||
+			!grow(&b->init, &b->init_size,
+				b->init_count + chip.init_len, sizeof(*b->init)))
+		goto oom;
+
+	entry = &b->entries[b->count];
+	memset(entry, 0, sizeof(*entry));
+	if (!add_string(b, name + prefix, len - prefix - suffix, &entry->file) ||
+			!add_vendor(b, chip.vendor, &entry->vendor) ||
+			!add_string(b, chip.name, strlen(chip.name), &entry->name))
+		goto oom;
+
+	entry->size = chip.size;
+	entry->init = b->init_count;
+	entry->init_len = chip.init_len;
+	if (!get_chip_init_val(&chip, 0x23, FPGA_REG_DEVID, &devid) &&
+			!get_chip_init_val(&chip, 0x23, FPGA_REG_VENDID, &venid)) {
+		entry->flags |= CHIP_HAS_IDS;
+		entry->venid = venid;
+		entry->devid = devid;
+	}
+
+	memcpy(b->init[b->init_count], chip.init,
+			chip.init_len * sizeof(*b->init));
+	b->init_count += chip.init_len;
+	b->count++;
+	return 0;
+
+oom:
+	b->failed = 1;
+	return 1;
+}
+
+/* By ID, then in archive order */
+static int compare_ids(const void *a, const void *b)
+{
+	const struct chip_id *x = a, *y = b;
+
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
+
+/* Point the table into its file image, checking everything it refers to */
+static int table_setup(struct chip_table *table, unsigned char *data,
+		size_t length, const struct tar_stamp *stamp)
+{
+	const struct chip_table_header *hdr = (const void *)data;
+	uint64_t entries_end;
+	unsigned int i;
+
+	if (length < sizeof(*hdr) ||
+			memcmp(hdr->magic, CHIP_TABLE_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != CHIP_TABLE_VERSION ||
+			hdr->archive_size != stamp->size ||
+			hdr->archive_mtime != stamp->mtime ||
+			hdr->archive_crc != stamp->crc)
+		return 0;
+
+	entries_end = sizeof(*hdr) +
+			(uint64_t)hdr->count * sizeof(struct chip_entry);
+	if (entries_end > hdr->ids || hdr->ids % sizeof(struct chip_id) ||
+			(uint64_t)hdr->ids + (uint64_t)hdr->ids_count *
+				sizeof(struct chip_id) > hdr->strings ||
+			!hdr->strings_size ||
+			(uint64_t)hdr->strings + hdr->strings_size > length ||
+			data[hdr->strings + hdr->strings_size - 1] != '\0' ||
+			(uint64_t)hdr->init + (uint64_t)hdr->init_count *
+				BYTES_PER_INIT_ENTRY > length ||
+			hdr->db_version >= hdr->strings_size)
+		return 0;
+
+	table->entries = (const void *)(data + sizeof(*hdr));
+	table->count = hdr->count;
+	table->strings = (const char *)data + hdr->strings;
+	table->init = (const void *)(data + hdr->init);
+	table->ids = (const void *)(data + hdr->ids);
+	table->ids_count = hdr->ids_count;
+	table->version = table->strings + hdr->db_version;
+
+	for (i = 0; i < table->count; i++) {
+		const struct chip_entry *e = &table->entries[i];
+
+		if (e->file >= hdr->strings_size ||
+				e->vendor >= hdr->strings_size ||
+				e->name >= hdr->strings_size ||
+				e->init_len > NUM_INIT_ENTRIES ||
+				(uint64_t)e->init + e->init_len > hdr->init_count)
+			return 0;
+	}
+
+	for (i = 0; i < table->ids_count; i++)
+		if (table->ids[i].entry >= table->count)
+			return 0;
+
+	table->data = data;
+	table->length = length;
+	return 1;
+}
+
+static struct chip_table *table_load(const char *filename,
+		const struct tar_stamp *stamp)
+{
+	struct chip_table *table;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	table = calloc(1, sizeof(*table));
+	if (!table || !table_setup(table, map, st.st_size, stamp)) {
+		munmap(map, st.st_size);
+		free(table);
+		return NULL;
+	}
+	table->mapped = 1;
+
+	return table;
+}
+
+static struct chip_table *table_build(TFILE *configs,
+		const struct tar_stamp *stamp)
+{
+	struct table_builder b = { 0 };
+	struct chip_table_header hdr;
+	struct chip_table *table = NULL;
+	unsigned char *data = NULL;
+	struct chip_id *ids = NULL;
+	size_t entries_len, ids_count = 0, length;
+	size_t i;
+
+	/* offset 0 is the empty string, in case there is no VERSION */
+	if (!add_string(&b, "", 0, &b.db_version))
+		goto out;
+	tar_for_each(configs, add_config, &b);
+	if (b.failed)
+		goto out;
+
+	ids = malloc((b.count + 1) * sizeof(*ids));
+	if (!ids)
+		goto out;
+	for (i = 0; i < b.count; i++) {
+		if (!(b.entries[i].flags & CHIP_HAS_IDS))
+			continue;
+		ids[ids_count].id = (uint32_t)b.entries[i].venid << 16 |
+				b.entries[i].devid;
+		ids[ids_count].entry = i;
+		ids_count++;
+	}
+	qsort(ids, ids_count, sizeof(*ids), compare_ids);
+
+	entries_len = b.count * sizeof(*b.entries);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CHIP_TABLE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CHIP_TABLE_VERSION;
+	hdr.count = b.count;
+	hdr.archive_size = stamp->size;
+	hdr.archive_mtime = stamp->mtime;
+	hdr.archive_crc = stamp->crc;
+	/* the entries are 28 bytes, so the ID index may need padding */
+	hdr.ids = (sizeof(hdr) + entries_len + sizeof(*ids) - 1) &
+			~(sizeof(*ids) - 1);
+	hdr.ids_count = ids_count;
+	hdr.strings = hdr.ids + ids_count * sizeof(*ids);
+	hdr.strings_size = b.strings_len;
+	hdr.init = hdr.strings + hdr.strings_size;
+	hdr.init_count = b.init_count;
+	hdr.db_version = b.db_version;
+	length = hdr.init + b.init_count * sizeof(*b.init);
+
+	data = malloc(length);
+	table = calloc(1, sizeof(*table));
+	if (!data || !table)
+		goto out;
+
+	memcpy(data, &hdr, sizeof(hdr));
+	memcpy(data + sizeof(hdr), b.entries, entries_len);
+	memset(data + sizeof(hdr) + entries_len, 0,
+			hdr.ids - sizeof(hdr) - entries_len);
+	memcpy(data + hdr.ids, ids, ids_count * sizeof(*ids));
+	memcpy(data + hdr.strings, b.strings, b.strings_len);
+	memcpy(data + hdr.init, b.init, b.init_count * sizeof(*b.init));
+
+	if (!table_setup(table, data, length, stamp)) {
+		free(table);
+		table = NULL;
+		goto out;
+	}
+	data = NULL;
+
+out:
+	if (!table)
+		printf("Could not compile the chip database.\n");
+	free(data);
+	free(ids);
+	free(b.entries);
+	free(b.strings);
+	free(b.init);
+	return table;
+}
+
+static void table_write(const char *filename, const struct chip_table *table)
+{
+	size_t len = strlen(filename) + 5;
+	char *tmpname = malloc(len);
+	FILE *f;
+	int ok;
+
+	if (!tmpname)
+		return;
+	snprintf(tmpname, len, "%s.tmp", filename);
+
+	f = fopen(tmpname, "wb");
+	if (!f) {
+		free(tmpname);
+		return;
+	}
+
+	ok = fwrite(table->data, table->length, 1, f) == 1;
+	ok = !fclose(f) && ok;
+
+	/* Readers either see the old table or the complete new one */
+	if (!ok || rename(tmpname, filename))
+		unlink(tmpname);
+	free(tmpname);
+}
+
+/**
+ * chip_table_open: load the chip database
+ *
+ * Uses $EM100_HOME/chips.bin if it was compiled from the current
+ * configs.tar.xz, and compiles it otherwise.
+ */
+struct chip_table *chip_table_open(void)
+{
+	char *archive = get_em100_file("configs.tar.xz");
+	char *tablename = get_em100_file("chips.bin");
+	char *cachename = get_em100_file("configs.cache");
+	struct chip_table *table = NULL;
+	struct tar_stamp stamp;
+	TFILE *configs;
+
+	if (!tar_stamp(archive, &stamp)) {
+		printf("Can't find chip configs in $EM100_HOME/configs.tar.xz.\n"
+				"Please run: em100 --update-files.\n");
+		goto out;
+	}
+
+	table = table_load(tablename, &stamp);
+	if (table)
+		goto out;
+
+	configs = tar_load_cached(archive, cachename);
+	if (!configs)
+		goto out;
+
+	table = table_build(configs, &stamp);
+	tar_close(configs);
+	if (table)
+		table_write(tablename, table);
+
+out:
+	free(archive);
+	free(tablename);
+	free(cachename);
+	return table;
+}
+
+/**
+ * chip_table_find: look up a chip by config name, as given to --set
+ * @param table: chip database
+ * @param name: config file name without directory and .cfg, in any case
+ */
+const struct chip_entry *chip_table_find(const struct chip_table *table,
+		const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < table->count; i++)
+		if (!strcasecmp(table->strings + table->entries[i].file, name))
+			return &table->entries[i];
+	return NULL;
+}
+
+/**
+ * chip_table_lookup: find the chips that set VENDID and DEVID in the FPGA
+ * @param table: chip database
+ * @param venid: value of FPGA_REG_VENDID
+ * @param devid: value of FPGA_REG_DEVID
+ * @param count: number of matching chips
+ *
+ * Returns the first of count consecutive index entries, each naming one
+ * chip in table->entries.
+ */
+const struct chip_id *chip_table_lookup(const struct chip_table *table,
+		uint16_t venid, uint16_t devid, unsigned int *count)
+{
+	uint32_t id = (uint32_t)venid << 16 | devid;
+	unsigned int low = 0, high = table->ids_count, end;
+
+	/* first entry with an ID >= id */
+	while (low < high) {
+		unsigned int mid = low + (high - low) / 2;
+
+		if (table->ids[mid].id < id)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	for (end = low; end < table->ids_count && table->ids[end].id == id; end++)
+		;
+	*count = end - low;
+	return &table->ids[low];
+}
+
+/**
+ * chip_table_desc: fill in the description of a chip
+ * @param table: chip database
+ * @param entry: chip in the database
+ * @param chip: description, valid as long as the table is open
+ */
+void chip_table_desc(const struct chip_table *table,
+		const struct chip_entry *entry, chipdesc *chip)
+{
+	chip->vendor = table->strings + entry->vendor;
+	chip->name = table->strings + entry->name;
+	chip->size = entry->size;
+	chip->init_len = entry->init_len;
+	memcpy(chip->init, table->init[entry->init],
+			entry->init_len * sizeof(*table->init));
+}
+
+void chip_table_free(struct chip_table *table)
+{
+	if (!table)
+		return;
+	if (table->mapped)
+		munmap(table->data, table->length);
+	else
+		free(table->data);
+	free(table);
+}
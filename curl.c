@@ -168,20 +168,25 @@ int update_all_files(void)
 	unlink(tmp_version);
 	free(tmp_version);
 
-	/* Compare time stamps and bail out if we have the latest version */
+	/* Compare time stamps and download everything if there is a newer version */
 	if (old_time >= new_time) {
 		printf("Current version: %s. No newer version available.\n", old_version);
-		return 0;
+	} else {
+		if (old_time == 0)
+			printf("Downloading latest version: %s\n", new_version);
+		else
+			printf("Update available: %s (installed: %s)\n", new_version, old_version);
+		download(version_name, version_id);
+		download(configs_name, configs_id);
+		download(firmware_name, firmware_id);
 	}
 
-	/* Download everything */
-	if (old_time == 0)
-		printf("Downloading latest version: %s\n", new_version);
-	else
-		printf("Update available: %s (installed: %s)\n", new_version, old_version);
-	download(version_name, version_id);
-	download(configs_name, configs_id);
-	download(firmware_name, firmware_id);
+	/* Compile the chip database, unless it is up to date already */
+	struct chip_table *chips = chip_table_open();
+	if (!chips)
+		return 1;
+	printf("Chip database: %u chips.\n", chips->count);
+	chip_table_free(chips);
 
 	return 0;
 }
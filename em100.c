@@ -25,7 +25,6 @@
 
 #include "em100.h"
 
-TFILE *configs;
 char *database_version;
 int debug = 0;
 
@@ -56,6 +55,8 @@ static int set_state(struct em100 *em100, int run)
 
 	if (retval)
 		printf("%s EM100Pro\n", run ? "Started" : "Stopped");
+	else
+		printf("Failed to %s EM100Pro\n", run ? "start" : "stop");
 
 	return retval;
 }
@@ -100,8 +101,10 @@ static int set_hold_pin_state(struct em100 *em100, int pin_state)
 		printf("Couldn't get hold pin state.\n");
 		return 0;
 	}
-	write_fpga_register(em100, 0x2a, (1 << 2) | val);
-
+	if (!write_fpga_register(em100, 0x2a, (1 << 2) | val)) {
+		printf("Couldn't acknowledge hold pin state.\n");
+		return 0;
+	}
 
 	if (!read_fpga_register(em100, 0x2a, &val)) {
 		printf("Couldn't get hold pin state.\n");
@@ -109,7 +112,10 @@ static int set_hold_pin_state(struct em100 *em100, int pin_state)
 	}
 
 	/* Now set desired pin state. */
-	write_fpga_register(em100, 0x2a, pin_state);
+	if (!write_fpga_register(em100, 0x2a, pin_state)) {
+		printf("Couldn't set hold pin state.\n");
+		return 0;
+	}
 
 	/* Read the pin state. */
 	if (!read_fpga_register(em100, 0x2a, &val)) {
@@ -242,9 +248,15 @@ static int set_serialno(struct em100 *em100, unsigned int serialno)
 		 * the SPI flash ID is requires to
 		 * actually unlock the chip.
 		 */
-		unlock_spi_flash(em100);
+		if (!unlock_spi_flash(em100)) {
+			printf("Error: Could not unlock SPI flash.\n");
+			return 0;
+		}
 		get_spi_flash_id(em100);
-		erase_spi_flash_sector(em100, 0x1f);
+		if (!erase_spi_flash_sector(em100, 0x1f)) {
+			printf("Error: Could not erase SPI flash.\n");
+			return 0;
+		}
 		/* write back magic */
 		write_spi_flash_page(em100, 0x1f0000, data + 256);
 	}
@@ -332,6 +344,9 @@ static int em100_init(struct em100 *em100, libusb_context *ctx,
 	em100->dev = dev;
 	em100->ctx = ctx;
 
+	if (!usb_init(ctx, dev))
+		return 0;
+
 	if (!check_status(em100)) {
 		printf("Device status unknown.\n");
 		return 0;
@@ -420,6 +435,7 @@ static int em100_attach(struct em100 *em100, int bus, int device,
 						(serial_number == em100->serialno))
 						break;
 
+					usb_exit();
 					libusb_release_interface(dev, 0);
 					libusb_close(dev);
 					em100->dev = NULL;
@@ -450,6 +466,8 @@ static int em100_attach(struct em100 *em100, int bus, int device,
 
 static int em100_detach(struct em100 *em100)
 {
+	usb_exit();
+
 	if (libusb_release_interface(em100->dev, 0) != 0) {
 		printf("Releasing interface failed.\n");
 		return 1;
@@ -461,6 +479,13 @@ static int em100_detach(struct em100 *em100)
 	return 0;
 }
 
+/* Leave after an error, detaching still sends any queued commands */
+static int em100_abort(struct em100 *em100, int status)
+{
+	em100_detach(em100);
+	return status;
+}
+
 static int em100_list(void)
 {
 	struct em100 em100;
@@ -514,7 +539,7 @@ static int em100_list(void)
 static int set_chip_type(struct em100 *em100, const chipdesc *desc)
 {
 	unsigned char cmd[16];
-	/* result counts unsuccessful send_cmd()s.
+	/* result counts commands that could not be queued or failed.
          * These are then converted in a boolean success value
          */
 	int result = 0;
@@ -568,63 +593,32 @@ static int set_chip_type(struct em100 *em100, const chipdesc *desc)
 	 * Set FPGA registers as the Dediprog software does:
 	 * 0xc4 is set every time the chip type is updated
 	 * 0x10 and 0x81 are set once when the software is initialized.
+	 * The init sequence is pipelined, write_fpga_register() waits for
+	 * it and fails if any of it did not arrive.
 	 */
-	write_fpga_register(em100, 0xc4, 0x01);
-	write_fpga_register(em100, 0x10, 0x00);
-	write_fpga_register(em100, 0x81, 0x00);
+	result += !write_fpga_register(em100, 0xc4, 0x01);
+	result += !write_fpga_register(em100, 0x10, 0x00);
+	result += !write_fpga_register(em100, 0x81, 0x00);
 
 	return !result;
 }
 
-/**
- * Searches for a specific FPGA register in the chip initialisation
- * sequence and returns the value in out.
- *
- * @reg1: e.g. FPGA write command (0x23)
- * @reg2: e.g. FPGA register
- *
- * Returns 0 on success.
- */
-static int get_chip_init_val(const chipdesc *desc,
-			     const uint8_t reg1,
-			     const uint8_t reg2,
-			     uint16_t *out)
-{
-	int i;
-
-	for (i = 0; i < desc->init_len; i++) {
-		if (desc->init[i][0] == reg1 && desc->init[i][1] == reg2) {
-			*out = (desc->init[i][2] << 8) | desc->init[i][3];
-			return 0;
-		}
-	}
-
-	return 1;
-}
+static struct chip_table *chips;
 
-typedef struct {
-	uint16_t venid;
-	uint16_t devid;
-	int found;
-	chipdesc chip;
-} vendev_t;
-
-static int get_chip_type_entry(char *name __unused, TFILE *dcfg, void *data, int ok __unused)
+/*
+ * The chip database is only loaded by commands that need it, from the
+ * table compiled out of $EM100_HOME/configs.tar.xz.
+ */
+static struct chip_table *get_chips(void)
 {
-	uint16_t comp;
-	chipdesc chip;
-
-	vendev_t *v = (vendev_t *)data;
+	if (chips)
+		return chips;
 
-	parse_dcfg(&chip, dcfg);
+	chips = chip_table_open();
+	if (chips)
+		database_version = (char *)chips->version;
 
-	if (get_chip_init_val(&chip, 0x23, FPGA_REG_DEVID, &comp) || v->devid != comp)
-		return 0;
-	if (get_chip_init_val(&chip, 0x23, FPGA_REG_VENDID, &comp) || v->venid != comp)
-		return 0;
-	v->found = 1;
-	v->chip = chip;
-	return 1;
+	return chips;
 }
 
 /**
@@ -632,74 +626,89 @@ static int get_chip_type_entry(char *name __unused, TFILE *dcfg, void *data, int
  * known registers in the FPGA and matches those bits with the
  * chip initialisation sequence.
  *
- * Returns 0 on success.
+ * Several chips may set the same registers. That's fine as long as
+ * they have the same size, otherwise the user has to pick one.
+ *
+ * Returns 0 on success, 1 if the chip is unknown and 2 if it is
+ * ambiguous.
  */
 static int get_chip_type(struct em100 *em100, chipdesc *out)
 {
-	vendev_t v;
+	const struct chip_id *ids;
+	uint16_t venid, devid;
+	unsigned int i, count, ambiguous = 0;
 
 	/* Read manufacturer and vendor id from FPGA */
-	if (!read_fpga_register(em100, FPGA_REG_VENDID, &v.venid))
+	if (!read_fpga_register(em100, FPGA_REG_VENDID, &venid))
 		return 1;
-	if (!read_fpga_register(em100, FPGA_REG_DEVID, &v.devid))
+	if (!read_fpga_register(em100, FPGA_REG_DEVID, &devid))
 		return 1;
 
-	tar_for_each(configs, get_chip_type_entry, (void *)&v);
-	if (!v.found)
+	if (!get_chips())
 		return 1;
 
-	*out = v.chip;
+	ids = chip_table_lookup(chips, venid, devid, &count);
+	if (!count) {
+		printf("No chip with VENDID %04x and DEVID %04x in the "
+			"database.\n", venid, devid);
+		return 1;
+	}
 
+	for (i = 1; i < count; i++)
+		if (chips->entries[ids[i].entry].size !=
+				chips->entries[ids[0].entry].size)
+			ambiguous = 1;
+
+	if (count > 1) {
+		printf("VENDID %04x and DEVID %04x match %u chips:\n",
+			venid, devid, count);
+		for (i = 0; i < count; i++) {
+			const struct chip_entry *entry =
+				&chips->entries[ids[i].entry];
+
+			printf("  • %s %s (%dkB)\n",
+				chips->strings + entry->vendor,
+				chips->strings + entry->name,
+				entry->size / 1024);
+		}
+	}
+	if (ambiguous) {
+		printf("Their sizes differ, please select the chip with --set.\n");
+		return 2;
+	}
+
+	chip_table_desc(chips, &chips->entries[ids[0].entry], out);
 	return 0;
 }
 
-static int list_chips_entry(char *name __unused, TFILE *file, void *data __unused, int ok __unused)
+static void list_chips(void)
 {
-	static chipdesc chip;
-	/* Is the file a dcfg file? Then print the name, otherwise skip. */
+	unsigned int i;
 
-	if (!parse_dcfg(&chip, file))
-		printf("  • %s %s\n", chip.vendor, chip.name);
-
-	return 0;
+	for (i = 0; i < chips->count; i++)
+		printf("  • %s %s\n",
+			chips->strings + chips->entries[i].vendor,
+			chips->strings + chips->entries[i].name);
 }
 
 static chipdesc *setup_chips(const char *desiredchip)
 {
 	static chipdesc chip;
-	char *configs_name = get_em100_file("configs.tar.xz");
-	configs = tar_load_compressed(configs_name);
-	free(configs_name);
-	if (!configs) {
-		printf("Can't find chip configs in $EM100_HOME/configs.tar.xz.\n"
-				"Please run: em100 --update-files.\n");
-		return NULL;
-	}
+	const struct chip_entry *entry;
 
-	TFILE *version = tar_find(configs,"configs/VERSION", 1);
-	if (!version) {
-		printf("Can't find VERSION of chip configs.\n");
+	if (!desiredchip || !get_chips())
 		return NULL;
-	}
-	database_version = (char *)version->address;
-	tar_close(version);
 
-	if (desiredchip) {
-		char chipname[256];
-		sprintf(chipname, "configs/%s.cfg", desiredchip);
-		TFILE *dcfg = tar_find(configs, chipname, 0);
-		if (!dcfg) {
-			printf("Supported chips:\n\n");
-			tar_for_each(configs, list_chips_entry, NULL);
-			printf("\nCould not find a chip matching '%s' to be emulated.\n",
-					desiredchip);
-			return NULL;
-		}
-		parse_dcfg(&chip, dcfg);
-		tar_close(dcfg);
-		return &chip;
+	entry = chip_table_find(chips, desiredchip);
+	if (!entry) {
+		printf("Supported chips:\n\n");
+		list_chips();
+		printf("\nCould not find a chip matching '%s' to be emulated.\n",
+				desiredchip);
+		return NULL;
 	}
-	return NULL;
+	chip_table_desc(chips, entry, &chip);
+	return &chip;
 }
 
 static char *get_em100_home(void)
@@ -759,6 +768,13 @@ static const struct option longopts[] = {
 	{"help", 0, 0, 'h'},
 	{"trace", 0, 0, 't'},
 	{"offset", 1, 0, 'O'},
+	{"trace-capture", 1, 0, 'W'},
+	{"trace-stats", 1, 0, 'M'},
+	{"fmap", 1, 0, 'm'},
+	{"trace-filter", 1, 0, 'e'},
+	{"trace-reports", 1, 0, 'N'},
+	{"trace-timeout", 1, 0, 'w'},
+	{"trace-trigger", 1, 0, 'G'},
 	{"set-serialno", 1, 0, 'S'},
 	{"firmware-update", 1, 0, 'F'},
 	{"firmware-dump", 1, 0, 'f'},
@@ -767,7 +783,9 @@ static const struct option longopts[] = {
 	{"list-devices", 0, 0, 'l'},
 	{"update-files", 0, 0, 'U'},
 	{"terminal", 0, 0, 'T'},
+	{"lookup-table", 1, 0, 'L'},
 	{"compatible", 0, 0, 'C'},
+	{"incremental", 0, 0, 'i'},
 	{NULL, 0, 0, 0}
 };
 
@@ -783,9 +801,18 @@ static void usage(char *name)
 		"  -r|--start:                     em100 shall run\n"
 		"  -s|--stop:                      em100 shall stop\n"
 		"  -v|--verify:                    verify EM100 content matches the file\n"
+		"  -i|--incremental:               only download blocks changed since last download\n"
 		"  -t|--trace:                     trace mode\n"
 		"  -O|--offset HEX_VAL:            address offset for trace mode\n"
+		"  -W|--trace-capture FILE:        capture raw SPI trace into FILE\n"
+		"  -M|--trace-stats FILE:          SPI access statistics, CSV or .json\n"
+		"  -m|--fmap FILE:                 image with FMAP for --trace-stats\n"
+		"  -e|--trace-filter EXPR:         only decode matching SPI commands\n"
+		"  -N|--trace-reports NUM:         trace reports per USB request (1-64)\n"
+		"  -w|--trace-timeout MS:          device side timeout of trace requests (0-60000)\n"
+		"  -G|--trace-trigger MODE:        start trace: software, emulation, pin\n"
 		"  -T|--terminal:                  terminal mode\n"
+		"  -L|--lookup-table FILE:         strings for HT lookup table messages\n"
 		"  -F|--firmware-update FILE|auto: update EM100pro firmware (dangerous)\n"
 		"  -f|--firmware-dump FILE:        export raw EM100pro firmware to file\n"
 		"  -g|--firmware-write FILE:       export EM100pro firmware to DPFW file\n"
@@ -810,17 +837,27 @@ int main(int argc, char **argv)
 	const char *filename = NULL, *read_filename = NULL;
 	const char *firmware_in = NULL, *firmware_out = NULL;
 	const char *holdpin = NULL;
+	const char *capture_filename = NULL;
+	const char *stats_filename = NULL, *fmap_filename = NULL;
+	const char *filter_expr = NULL, *lookup_filename = NULL;
+	struct trace_options trace_opts = {
+		.reports = REPORT_BUFFER_COUNT,
+		.trigger = TRACE_TRIGGER_SOFTWARE,
+	};
 	int do_start = 0, do_stop = 0;
 	int verify = 0, trace = 0, terminal=0;
 	int compatibility = 0;
+	int incremental = 0;
 	int bus = 0, device = 0;
 	int firmware_is_dpfw = 0;
 	unsigned int serial_number = 0;
 	unsigned long address_offset = 0;
+	unsigned long timeout;
+	char *end;
 	unsigned int spi_start_address = 0;
 	const char *voltage = NULL;
 
-	while ((opt = getopt_long(argc, argv, "c:d:a:u:rsvtO:F:f:g:S:V:p:DCx:lUhT",
+	while ((opt = getopt_long(argc, argv, "c:d:a:u:rsvitO:W:M:m:e:N:w:G:L:F:f:g:S:V:p:DCx:lUhT",
 				  longopts, &idx)) != -1) {
 		switch (opt) {
 		case 'c':
@@ -852,6 +889,9 @@ int main(int argc, char **argv)
 		case 'v':
 			verify = 1;
 			break;
+		case 'i':
+			incremental = 1;
+			break;
 		case 't':
 			trace = 1;
 			break;
@@ -859,9 +899,56 @@ int main(int argc, char **argv)
 			sscanf(optarg, "%lx", &address_offset);
 			printf("Address offset: 0x%08lx\n", address_offset);
 			break;
+		case 'W':
+			capture_filename = optarg;
+			trace = 1;
+			break;
+		case 'M':
+			stats_filename = optarg;
+			trace = 1;
+			break;
+		case 'm':
+			fmap_filename = optarg;
+			break;
+		case 'e':
+			filter_expr = optarg;
+			trace = 1;
+			break;
+		case 'N':
+			trace_opts.reports = strtoul(optarg, NULL, 0);
+			if (trace_opts.reports < 1 ||
+			    trace_opts.reports > REPORT_BUFFER_MAX_COUNT) {
+				printf("Invalid number of trace reports: %s\n",
+						optarg);
+				return 1;
+			}
+			break;
+		case 'w':
+			timeout = strtoul(optarg, &end, 0);
+			if (!*optarg || *end || timeout > TRACE_TIMEOUT_MAX) {
+				printf("Invalid trace timeout: %s\n", optarg);
+				return 1;
+			}
+			trace_opts.timeout = timeout;
+			break;
+		case 'G':
+			if (!strcasecmp(optarg, "software"))
+				trace_opts.trigger = TRACE_TRIGGER_SOFTWARE;
+			else if (!strcasecmp(optarg, "emulation"))
+				trace_opts.trigger = TRACE_TRIGGER_EMULATION;
+			else if (!strcasecmp(optarg, "pin"))
+				trace_opts.trigger = TRACE_TRIGGER_PIN;
+			else {
+				printf("Invalid trace trigger: %s\n", optarg);
+				return 1;
+			}
+			break;
 		case 'T':
 			terminal = 1;
 			break;
+		case 'L':
+			lookup_filename = optarg;
+			break;
 		case 'S':
 			serialno = optarg;
 			break;
@@ -903,6 +990,16 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (lookup_filename && !terminal) {
+		printf("--lookup-table requires --terminal.\n");
+		return 1;
+	}
+
+	if (incremental && spi_start_address) {
+		printf("--incremental can't be combined with --start-address.\n");
+		return 1;
+	}
+
 	struct em100 em100;
 	if (!em100_attach(&em100, bus, device, serial_number)) {
 		return 1;
@@ -910,7 +1007,7 @@ int main(int argc, char **argv)
 
 	const chipdesc *chip = setup_chips(desiredchip);
 	if (desiredchip && !chip)
-		return 1;
+		return em100_abort(&em100, 1);
 
 
 	if (em100.hwversion == HWVERSION_EM100PRO || em100.hwversion == HWVERSION_EM100PRO_EARLY) {
@@ -942,7 +1039,8 @@ int main(int argc, char **argv)
 				em100.hwversion == HWVERSION_EM100PRO_EARLY ? "DP" : "EM", em100.serialno);
 	else
 		printf("Serial number: N.A.\n");
-	printf("SPI flash database: %s\n", database_version);
+	if (database_version)
+		printf("SPI flash database: %s\n", database_version);
 	get_current_state(&em100);
 	get_current_pin_state(&em100);
 	printf("\n");
@@ -982,13 +1080,14 @@ int main(int argc, char **argv)
 	}
 
 	if (do_stop) {
-		set_state(&em100, 0);
+		if (!set_state(&em100, 0))
+			return em100_abort(&em100, 1);
 	}
 
 	if (desiredchip) {
 		if (!set_chip_type(&em100, chip)) {
 			printf("Failed configuring chip type.\n");
-			return 0;
+			return em100_abort(&em100, 1);
 		}
 		printf("Chip set to %s %s.\n", chip->vendor, chip->name);
 	}
@@ -996,166 +1095,192 @@ int main(int argc, char **argv)
 	if (voltage) {
 		if (!set_fpga_voltage_from_str(&em100, voltage)) {
 			printf("Failed configuring FPGA voltage.\n");
-			return 1;
+			return em100_abort(&em100, 1);
 		}
 	}
 
 	if (holdpin) {
 		if (!set_hold_pin_state_from_str(&em100, holdpin)) {
 			printf("Failed configuring hold pin state.\n");
-			return 0;
+			return em100_abort(&em100, 1);
 		}
 	}
 
 	if (read_filename) {
 		int maxlen = 0x4000000; /* largest size - 64MB */
+		struct image image;
+		int done;
 
 		if (!desiredchip) {
 			/* Read configured SPI emulation from EM100 */
 			chipdesc emulated_chip;
+			int ret = get_chip_type(&em100, &emulated_chip);
 
-			if (!get_chip_type(&em100, &emulated_chip)) {
+			if (!ret) {
 				printf("Configured to emulate %dkB chip\n", emulated_chip.size / 1024);
 				maxlen = emulated_chip.size;
+			} else if (ret == 2) {
+				return em100_abort(&em100, 1);
 			}
 		} else {
 			maxlen = chip->size;
 		}
 
-		void *data = malloc(maxlen);
-		if (data == NULL) {
-			printf("FATAL: couldn't allocate memory\n");
-			return 1;
-		}
-		FILE *fdata = fopen(read_filename, "wb");
-		if (!fdata) {
-			perror("Could not open download file");
-			free(data);
-			return 1;
+		/* Read straight into the (mapped) file */
+		if (!image_create(&image, read_filename, maxlen)) {
+			printf("Could not open download file\n");
+			return em100_abort(&em100, 1);
 		}
 
-		read_sdram(&em100, data, 0x00000000, maxlen);
+		done = read_sdram(&em100, image.data, 0x00000000, maxlen);
+		if (!done)
+			printf("FATAL: failed to read SDRAM\n");
 
-		int length = fwrite(data, maxlen, 1, fdata);
-		fclose(fdata);
-		free(data);
-
-		if (length != 1) {
-			printf("FATAL: failed to write");
-			return 1;
+		if (!image_close(&image)) {
+			printf("FATAL: failed to write\n");
+			done = 0;
 		}
+		if (!done)
+			return em100_abort(&em100, 1);
 	}
 
 	if (filename) {
 		unsigned int maxlen = desiredchip ? chip->size : 0x4000000; /* largest size - 64MB */
-		void *data = malloc(maxlen);
+		struct image image;
+		unsigned char *data;
+		unsigned int length;
 		int done;
-		void *readback = NULL;
-
-		if (data == NULL) {
-			printf("FATAL: couldn't allocate memory\n");
-			return 1;
-		}
-		FILE *fdata = fopen(filename, "rb");
-		if (!fdata) {
-			perror("Could not open upload file");
-			free(data);
-			return 1;
-		}
-
-		unsigned int length = 0;
-		while ((!feof(fdata)) && (length < maxlen)) {
-			int blocksize = 65536;
-			length += blocksize * fread(data+length, blocksize, 1,
-					fdata);
-		}
-		fclose(fdata);
 
-		if (length > maxlen) {
-			printf("FATAL: length > maxlen\n");
-			free(data);
-			return 1;
+		if (!image_load(&image, filename, maxlen)) {
+			printf("Could not open upload file\n");
+			return em100_abort(&em100, 1);
 		}
+		data = image.data;
+		length = image.length;
 
 		if (length == 0) {
 			printf("FATAL: No file to upload.\n");
-			free(data);
-			return 1;
+			image_close(&image);
+			return em100_abort(&em100, 1);
 		}
 
 		if (desiredchip && (length != (chip->size - spi_start_address)) )
 		{
 			printf("FATAL: file size does not match to chip size.\n");
-			free(data);
-			return 1;
+			image_close(&image);
+			return em100_abort(&em100, 1);
 		}
 
-		if (compatibility)
-			autocorrect_image(&em100, data, length);
+		if (spi_start_address + length > maxlen) {
+			printf("FATAL: image exceeds SDRAM at address 0x%08x.\n",
+					spi_start_address);
+			image_close(&image);
+			return em100_abort(&em100, 1);
+		}
 
-		if (spi_start_address) {
-			readback = malloc(maxlen);
-			if (readback == NULL) {
-				printf("FATAL: couldn't allocate memory(size: %x)\n", maxlen);
-				free(data);
-				return 1;
-			}
-			done = read_sdram(&em100, readback, 0, maxlen);
-			if (done) {
-				memcpy((unsigned char*)readback + spi_start_address, data, length);
-				write_sdram(&em100, (unsigned char*)readback, 0x00000000, maxlen);
-			} else {
-				printf("Error: sdram readback failed\n");
-			}
-			free(readback);
+		if (compatibility)
+			autocorrect_image(&em100, (char *)data, length);
+
+		if (incremental) {
+			done = write_sdram_incremental(&em100, data, length);
+		} else if (spi_start_address) {
+			/* Only touch [start, start + length) */
+			manifest_invalidate(&em100);
+			done = write_sdram_range(&em100, data,
+					spi_start_address, length);
 		} else {
-			write_sdram(&em100, (unsigned char*)data, 0x00000000, length);
+			manifest_invalidate(&em100);
+			done = write_sdram(&em100, data, 0x00000000, length);
+		}
+		if (!done) {
+			printf("FATAL: failed to upload file.\n");
+			image_close(&image);
+			return em100_abort(&em100, 1);
 		}
 
 		if (verify) {
-			readback = malloc(length);
-			if (readback == NULL) {
-				printf("FATAL: couldn't allocate memory\n");
-				free(data);
-				return 1;
+			done = verify_sdram(&em100, data, spi_start_address,
+					length);
+			if (!done && incremental) {
+				/* Don't trust the manifest anymore */
+				printf("Verify failed, downloading full image.\n");
+				manifest_invalidate(&em100);
+				write_sdram_incremental(&em100, data, length);
+				done = verify_sdram(&em100, data, 0, length);
 			}
-			done = read_sdram(&em100, readback, spi_start_address, length);
-			if (done && (memcmp(data, readback, length) == 0))
-				printf("Verify: PASS\n");
-			else
-				printf("Verify: FAIL\n");
-			free(readback);
+			printf("Verify: %s\n", done ? "PASS" : "FAIL");
 		}
 
-		free(data);
+		image_close(&image);
 	}
 
 	if (do_start) {
-		set_state(&em100, 1);
+		if (!set_state(&em100, 1))
+			return em100_abort(&em100, 1);
 	}
 
 	if (trace || terminal) {
 		struct sigaction signal_action;
+		struct trace_capture *capture = NULL;
+		struct trace_stats *stats = NULL;
+		struct trace_filter *filter = NULL;
+
+		if (filter_expr) {
+			filter = trace_filter_compile(filter_expr);
+			if (!filter)
+				return em100_abort(&em100, 1);
+		}
+
+		if (lookup_filename && !load_lookup_table(lookup_filename))
+			return em100_abort(&em100, 1);
+
+		if (capture_filename) {
+			capture = capture_create(capture_filename, &em100);
+			if (!capture)
+				return em100_abort(&em100, 1);
+		}
+
+		if (stats_filename) {
+			stats = trace_stats_create();
+			if (!stats)
+				return em100_abort(&em100, 1);
+			/* The downloaded image most likely has the FMAP */
+			if (!fmap_filename)
+				fmap_filename = filename;
+			if (fmap_filename)
+				trace_stats_load_fmap(stats, fmap_filename);
+		}
 
 		if ((holdpin == NULL) && (!set_hold_pin_state(&em100, 3))) {
 			printf("Error: Failed to set EM100 to input\n");
-			return 1;
+			return em100_abort(&em100, 1);
 		}
 
-		if (!do_start && !do_stop)
-			set_state(&em100, 1);
+		if (!do_start && !do_stop && !set_state(&em100, 1))
+			return em100_abort(&em100, 1);
+
+		if (trace && !reset_spi_trace(&em100)) {
+			printf("Failed to reset SPI trace.\n");
+			return em100_abort(&em100, 1);
+		}
+
+		if (terminal && !init_spi_terminal(&em100)) {
+			printf("Failed to set up SPI terminal.\n");
+			return em100_abort(&em100, 1);
+		}
 
 		printf ("Starting ");
 
 		if (trace) {
-			reset_spi_trace(&em100);
-			printf("trace%s", terminal ? " & " : "");
+			printf("trace%s%s%s%s", capture ? " capture" : "",
+					stats ? " statistics" : "",
+					trace_opts.trigger == TRACE_TRIGGER_PIN ?
+					" on TRIG" : "",
+					terminal ? " & " : "");
 		}
 
-		if (terminal) {
-			init_spi_terminal(&em100);
+		if (terminal)
 			printf("terminal");
-		}
 
 		printf(". Press CTL-C to exit.\n\n");
 		signal_action.sa_handler = exit_handler;
@@ -1163,13 +1288,26 @@ int main(int argc, char **argv)
 		sigemptyset(&signal_action.sa_mask);
 		sigaction(SIGINT, &signal_action, NULL);
 
-		while (!do_exit_flag) {
-			if (trace)
-				read_spi_trace(&em100, terminal,
-						address_offset);
-			else
-				read_spi_terminal(&em100, 0);
+		if (trace) {
+			trace_opts.terminal = terminal;
+			trace_opts.addr_offset = address_offset;
+			trace_opts.capture = capture;
+			trace_opts.stats = stats;
+			trace_opts.filter = filter;
+			run_spi_trace(&em100, &trace_opts, &do_exit_flag);
+		} else {
+			run_spi_terminal(&em100, &do_exit_flag);
+		}
+
+		if (capture)
+			capture_close(capture);
+
+		if (stats) {
+			trace_stats_report(stats, stats_filename);
+			trace_stats_free(stats);
 		}
+		trace_filter_free(filter);
+		free_lookup_table();
 
 		if (!do_start && !do_stop)
 			set_state(&em100, 0);
@@ -1178,7 +1316,7 @@ int main(int argc, char **argv)
 
 		if ((holdpin == NULL) && (!set_hold_pin_state(&em100, 2))) {
 			printf("Error: Failed to set EM100 to float\n");
-			return 1;
+			return em100_abort(&em100, 1);
 		}
 	}
 
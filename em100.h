@@ -14,6 +14,7 @@
 #ifndef __EM100_H__
 #define __EM100_H__
 
+#include <stdio.h>
 #include <libusb.h>
 
 #define __unused __attribute__((unused))
@@ -46,8 +47,36 @@ typedef struct {
 #define BULK_SEND_TIMEOUT	5000	/* sentinel value */
 
 /* usb.c */
+enum {
+	USB_REQUEST_IDLE = 0,
+	USB_REQUEST_QUEUED,
+	USB_REQUEST_SUBMITTED,
+	USB_REQUEST_DONE,
+	USB_REQUEST_FAILED
+};
+
+struct usb_request {
+	unsigned char endpoint;
+	unsigned char *buffer;
+	int length;
+	int actual;
+	int status;
+	unsigned int timeout;	/* ms, 0 for BULK_SEND_TIMEOUT */
+	void (*callback)(struct usb_request *req);
+	void *priv;
+	struct usb_request *next;
+};
+
+int usb_init(libusb_context *ctx, libusb_device_handle *dev);
+void usb_exit(void);
+int usb_submit(struct usb_request *req);
+int usb_wait(struct usb_request *req);
+void usb_flush(void);
 int send_cmd(libusb_device_handle *dev, void *data);
+int send_cmd_flush(void);
 int get_response(libusb_device_handle *dev, void *data, int length);
+int get_response_timeout(libusb_device_handle *dev, void *data, int length,
+		unsigned int timeout);
 
 /* firmware.c */
 int firmware_dump(struct em100 *em100, const char *filename,
@@ -74,6 +103,15 @@ void hexdump(const void *memory, size_t length);
 int read_sdram(struct em100 *em100, void *data, int address, int length);
 int write_sdram(struct em100 *em100, unsigned char *data, int address,
 		int length);
+int write_sdram_range(struct em100 *em100, unsigned char *data, int address,
+		int length);
+int verify_sdram(struct em100 *em100, unsigned char *data, int address,
+		int length);
+
+/* manifest.c */
+int write_sdram_incremental(struct em100 *em100, unsigned char *data,
+		unsigned int length);
+void manifest_invalidate(struct em100 *em100);
 
 /* spi.c */
 uint32_t get_spi_flash_id(struct em100 *em100);
@@ -166,20 +204,204 @@ typedef enum {
 	ht_lookup_table      = 0x07
 } ht_msg_type_t;
 
+#define REPORT_BUFFER_LENGTH	8192
+#define REPORT_BUFFER_COUNT	8	/* default reports per request */
+#define REPORT_BUFFER_MAX_COUNT	64
+#define REPORT_RECORD_LENGTH	8
+#define REPORT_MAX_RECORDS	1022
+#define TRACE_TIMEOUT_MAX	60000	/* ms */
+
+struct trace_capture;
+struct trace_stats;
+struct trace_filter;
+
+enum trace_trigger {
+	TRACE_TRIGGER_SOFTWARE,		/* start right away */
+	TRACE_TRIGGER_EMULATION,	/* trace while emulation is running */
+	TRACE_TRIGGER_PIN,		/* start when TRIG goes high */
+};
+
+struct trace_options {
+	int terminal;			/* also show uFIFO messages */
+	unsigned int reports;		/* per request, 0 for the default */
+	unsigned int timeout;		/* ms the device waits for data */
+	enum trace_trigger trigger;
+	unsigned long addr_offset;	/* added to printed addresses */
+	struct trace_capture *capture;	/* store instead of decoding */
+	struct trace_stats *stats;	/* collect instead of printing */
+	struct trace_filter *filter;	/* only decode matching commands */
+};
+
 int reset_spi_trace(struct em100 *em100);
-int read_spi_trace(struct em100 *em100, int display_terminal,
-		   unsigned long addr_offset);
-int read_spi_terminal(struct em100 *em100, int print_counter);
+int run_spi_trace(struct em100 *em100, const struct trace_options *opts,
+		volatile int *exit_flag);
+int run_spi_terminal(struct em100 *em100, volatile int *exit_flag);
+int load_lookup_table(const char *filename);
+void free_lookup_table(void);
 int init_spi_terminal(struct em100 *em100);
 
+/* tracedecode.c */
+#define TRACE_TICKS_PER_SECOND	100000000ULL
+
+/* Everything needed to resume decoding at a report boundary */
+struct trace_decoder_state {
+	unsigned long long counter;	/* commands seen so far */
+	unsigned long long timestamp;
+	unsigned long long start_timestamp;
+	unsigned int address;
+	unsigned char curpos;
+	unsigned char cmdid;
+	unsigned char opcode;
+	unsigned char outbytes;
+	unsigned char additional_pad_bytes;
+	unsigned char addr4;		/* 4-byte address mode */
+	unsigned char ext_addr;		/* extended address register */
+};
+
+struct trace_decoder {
+	struct trace_decoder_state state;
+	unsigned long addr_offset;
+	int muted;			/* current command is outside window */
+	int quiet;			/* don't print anything */
+	int scalar;			/* don't use trace_scan_report() */
+	struct trace_stats *stats;	/* optional statistics */
+	struct trace_filter *filter;	/* optional command filter */
+	struct trace_image *image;	/* optional flash reconstruction */
+	unsigned long long read_bytes;	/* flash data read, unless muted */
+
+	/* only commands in this window are printed */
+	unsigned long long first_command, last_command;
+	unsigned long long start_time, end_time;
+};
+
+enum spi_class {
+	SPI_CLASS_OTHER,
+	SPI_CLASS_READ,
+	SPI_CLASS_FAST_READ,
+	SPI_CLASS_DUAL_READ,
+	SPI_CLASS_QUAD_READ,
+	SPI_CLASS_PROGRAM,
+	SPI_CLASS_ERASE,
+	SPI_CLASS_STATUS,
+	SPI_CLASS_ID,
+	SPI_CLASSES
+};
+
+const char *trace_command_name(uint8_t opcode);
+int trace_command_class(uint8_t opcode);
+void trace_decoder_init(struct trace_decoder *dec, unsigned long addr_offset);
+unsigned long long trace_decoder_time(const struct trace_decoder *dec);
+void trace_decode_report(struct trace_decoder *dec, const unsigned char *data);
+
+/* tracescan.c */
+#define TRACE_SCAN_WORDS	((REPORT_MAX_RECORDS + 63) / 64)
+
+enum {
+	TRACE_SCAN_SCALAR,
+	TRACE_SCAN_SSE2,
+	TRACE_SCAN_AVX2,
+	TRACE_SCANNERS
+};
+
+struct trace_scan {
+	uint64_t timestamp[TRACE_SCAN_WORDS];	/* command id is 0xff */
+	uint64_t boundary[TRACE_SCAN_WORDS];	/* command id changed */
+};
+
+int trace_scan_select(int which);
+const char *trace_scan_name(int which);
+void trace_scan_report(const unsigned char *records, unsigned int count,
+		unsigned char prev, struct trace_scan *scan);
+
+/* tracefilter.c */
+struct trace_filter *trace_filter_compile(const char *expr);
+int trace_filter_match(const struct trace_filter *filter, uint8_t opcode,
+		int has_addr, unsigned long long address,
+		unsigned long long time);
+void trace_filter_free(struct trace_filter *filter);
+
+/* traceimage.c */
+struct trace_image *trace_image_create(void);
+void trace_image_data(struct trace_image *image, uint32_t address,
+		const unsigned char *data, unsigned int length);
+int trace_image_write(struct trace_image *image, const char *filename,
+		size_t length);
+int trace_image_report(struct trace_image *image, const char *filename);
+void trace_image_free(struct trace_image *image);
+
+/* tracestats.c */
+struct trace_stats *trace_stats_create(void);
+int trace_stats_load_fmap(struct trace_stats *stats, const char *filename);
+void trace_stats_command(struct trace_stats *stats, uint8_t opcode,
+		int uses_address, uint32_t address, uint64_t time);
+void trace_stats_data(struct trace_stats *stats, uint32_t address,
+		unsigned int length);
+int trace_stats_report(struct trace_stats *stats, const char *filename);
+void trace_stats_free(struct trace_stats *stats);
+
+/* capture.c */
+#define CAPTURE_BLOCK_TRACE	0x01
+
+struct trace_capture {
+	FILE *file;
+	uint64_t start;
+	uint64_t blocks;
+	uint64_t bytes;
+
+	/* only set for captures opened for reading */
+	uint64_t realtime;
+	uint32_t serialno;
+	uint32_t report_length;
+	uint8_t hwversion;
+	unsigned char *buffer;
+};
+
+struct capture_block {
+	uint8_t type;
+	uint16_t length;
+	uint64_t time;		/* ns since start of capture */
+	uint64_t offset;	/* of the block header in the file */
+	unsigned char *data;
+};
+
+struct trace_capture *capture_create(const char *filename,
+		struct em100 *em100);
+uint64_t capture_clock(void);
+int capture_write_reports(struct trace_capture *capture, uint64_t time,
+		unsigned char *reportdata, unsigned int count);
+struct trace_capture *capture_open(const char *filename);
+int capture_read_block(struct trace_capture *capture,
+		struct capture_block *block);
+int capture_seek(struct trace_capture *capture, uint64_t offset);
+int capture_close(struct trace_capture *capture);
+
 /* Archive handling */
+enum {
+	TFILE_BORROWED,		/* points into another TFILE */
+	TFILE_MALLOC,
+	TFILE_MMAP,		/* decompressed archive cache */
+};
+
+struct tar_index;
+
 typedef struct {
 	unsigned char *address;
 	size_t length;
 	int alloc;
+	struct tar_index *index;	/* built by the first lookup */
 } TFILE;
 TFILE *tar_find(TFILE *tfile, const char *name, int casesensitive);
 TFILE *tar_load_compressed(char *filename);
+TFILE *tar_load_cached(char *filename, const char *cachename);
+int tar_stream(const char *filename, int (*run)(char *, TFILE *, void *, int),
+		void *data);
+
+struct tar_stamp {
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t crc;
+};
+int tar_stamp(const char *filename, struct tar_stamp *stamp);
 int tar_for_each(TFILE *tfile, int (*run)(char *, TFILE *, void *, int), void *data);
 int tar_close(TFILE *tfile);
 int tar_ls(TFILE *tfile);
@@ -200,7 +422,59 @@ extern int debug;
 /* Chips */
 int parse_dcfg(chipdesc *chip, TFILE *dcfg);
 
+/* chiptable.c */
+#define CHIP_HAS_IDS	0x0001	/* venid and devid are set */
+
+struct chip_entry {
+	uint32_t file;		/* offsets into the string pool */
+	uint32_t vendor;
+	uint32_t name;
+	uint32_t size;
+	uint32_t init;		/* first entry in the init array */
+	uint16_t init_len;
+	uint16_t flags;
+	uint16_t venid;		/* FPGA_REG_VENDID and FPGA_REG_DEVID */
+	uint16_t devid;
+};
+
+struct chip_id {
+	uint32_t id;		/* VENDID << 16 | DEVID */
+	uint32_t entry;
+};
+
+struct chip_table {
+	const struct chip_entry *entries;
+	unsigned int count;
+	const struct chip_id *ids;	/* sorted by ID */
+	unsigned int ids_count;
+	const char *strings;
+	const uint8_t (*init)[BYTES_PER_INIT_ENTRY];
+	const char *version;
+
+	unsigned char *data;
+	size_t length;
+	int mapped;
+};
+
+struct chip_table *chip_table_open(void);
+const struct chip_entry *chip_table_find(const struct chip_table *table,
+		const char *name);
+const struct chip_id *chip_table_lookup(const struct chip_table *table,
+		uint16_t venid, uint16_t devid, unsigned int *count);
+void chip_table_desc(const struct chip_table *table,
+		const struct chip_entry *entry, chipdesc *chip);
+void chip_table_free(struct chip_table *table);
+
 /* Images */
+struct image {
+	unsigned char *data;
+	size_t length;
+	int mapped;
+	int fd;
+};
 int autocorrect_image(struct em100 *em100, char *image, size_t size);
+int image_load(struct image *image, const char *filename, size_t maxlen);
+int image_create(struct image *image, const char *filename, size_t length);
+int image_close(struct image *image);
 
 #endif
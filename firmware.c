@@ -102,7 +102,7 @@ int firmware_dump(struct em100 *em100, const char *filename,
 	data = malloc(rom_size);
 	if (data == NULL) {
 		perror("Out of memory.\n");
-		exit(1);
+		return 0;
 	}
 	memset(data, 0, rom_size);
 
@@ -143,7 +143,9 @@ int firmware_dump(struct em100 *em100, const char *filename,
 		default:
 			printf("Dumping DPFW firmware on hardware version %u is "
 					"not yet supported.\n", em100->hwversion);
-			exit(1);
+			fclose(fw);
+			free(data);
+			return 0;
 		}
 
 		memset(all_ff, 255, sizeof(all_ff));
@@ -154,8 +156,9 @@ int firmware_dump(struct em100 *em100, const char *filename,
 		if (i == 0x100000) {
 			printf("Can't parse device firmware. Please extract"
 					" raw firmware instead.\n");
+			fclose(fw);
 			free(data);
-			exit(1);
+			return 0;
 		}
 		fpga_size = i;
 
@@ -166,8 +169,9 @@ int firmware_dump(struct em100 *em100, const char *filename,
 		if (i == 0xfff00) {
 			printf("Can't parse device firmware. Please extract"
 					" raw firmware instead.\n");
+			fclose(fw);
 			free(data);
-			exit(1);
+			return 0;
 		}
 		mcu_size = i;
 
@@ -209,7 +213,9 @@ int firmware_dump(struct em100 *em100, const char *filename,
 }
 
 typedef struct {
-	TFILE *autoupdate_file;
+	unsigned char *fw;	/* copy of the newest matching file */
+	long fsize;
+	char name[101];
 	struct em100 *em100;
 } firmware_update_t;
 
@@ -219,25 +225,26 @@ static int firmware_update_entry(char *name, TFILE *file, void *data, int ok __u
 
 	/* firmware files are sorted oldest to newest */
 	/* filenames look like firmware/em100pro_fw_2.27_0.89_3.3V.dpfw */
-	if (update->em100->hwversion == HWVERSION_EM100PRO_EARLY ||
-			update->em100->hwversion == HWVERSION_EM100PRO) {
 #define FIRMWARE_PATH "firmware/em100pro_fw_"
-		if (strncmp(name, FIRMWARE_PATH, strlen(FIRMWARE_PATH)))
-			return 0;
-		/* The last file that matches is therefore the newest */
-
-		if ((update->em100->fpga & 0x8000 &&
-			strstr(name, "1.8V")) || strstr(name, "3.3V")) {
-			update->autoupdate_file=file;
-			printf("select %s\n", name);
-		}
+	if (strncmp(name, FIRMWARE_PATH, strlen(FIRMWARE_PATH)))
 		return 0;
-	}
+	/* The last file that matches is therefore the newest */
 
-	/* hwversion 6 */
-	printf("EM100Pro-G2 currently does not support auto-updating firmware.\n");
+	if ((update->em100->fpga & 0x8000 &&
+		strstr(name, "1.8V")) || strstr(name, "3.3V")) {
+		/* file is only valid during the call */
+		unsigned char *fw = realloc(update->fw, file->length);
 
-	return 1;
+		if (!fw) {
+			printf("ERROR: out of memory.\n");
+			return 1;
+		}
+		memcpy(fw, file->address, file->length);
+		update->fw = fw;
+		update->fsize = file->length;
+		snprintf(update->name, sizeof(update->name), "%s", name);
+	}
+	return 0;
 }
 
 int firmware_update(struct em100 *em100, const char *filename, int verify)
@@ -262,27 +269,38 @@ int firmware_update(struct em100 *em100, const char *filename, int verify)
 	default:
 		printf("Updating EM100Pro firmware on hardware version %u is "
 				"not yet supported.\n", em100->hwversion);
-		exit(1);
+		return 0;
 	}
 
 	if (!strncasecmp(filename, "auto", 5)) {
 		printf("\nAutomatic firmware update.\n");
-		TFILE *f = tar_load_compressed(get_em100_file("firmware.tar.xz"));
+		if (em100->hwversion == HWVERSION_EM100PRO_G2) {
+			printf("EM100Pro-G2 currently does not support "
+					"auto-updating firmware.\n");
+			return 0;
+		}
+		char *archive = get_em100_file("firmware.tar.xz");
 		firmware_update_t data;
 		data.em100 = em100;
-		data.autoupdate_file = NULL;
-		tar_for_each(f, firmware_update_entry, (void *)&data);
-		if (data.autoupdate_file == NULL) {
-			printf("Could not find suitable firmware for autoupdate\n");
+		data.fw = NULL;
+		data.fsize = 0;
+		/* what was copied is only trustworthy once the archive
+		 * decoded completely and its checksums matched */
+		if (!tar_stream(archive, firmware_update_entry, (void *)&data)) {
+			printf("ERROR: %s could not be verified, not updating.\n",
+					archive);
+			free(archive);
+			free(data.fw);
 			return 0;
 		}
-		fsize = data.autoupdate_file->length;
-		fw = malloc(fsize);
-		if (!fw) {
-			printf("ERROR: out of memory.\n");
+		free(archive);
+		if (data.fw == NULL) {
+			printf("Could not find suitable firmware for autoupdate\n");
 			return 0;
 		}
-		memcpy(fw, data.autoupdate_file->address, fsize);
+		printf("select %s\n", data.name);
+		fsize = data.fsize;
+		fw = data.fw;
 		automatic = 1;
 	} else {
 		FILE *f;
@@ -378,13 +396,21 @@ int firmware_update(struct em100 *em100, const char *filename, int verify)
 	 * the SPI flash ID is requires to
 	 * actually unlock the chip.
 	 */
-	unlock_spi_flash(em100);
+	if (!unlock_spi_flash(em100)) {
+		printf("ERROR: Could not unlock SPI flash.\n");
+		free(fw);
+		return 0;
+	}
 	get_spi_flash_id(em100);
 
 	printf("Erasing firmware:\n");
 	for (i=0; i<=0x1e; i++) {
 		print_progress(i * 100 / 0x1e);
-		erase_spi_flash_sector(em100, i);
+		if (!erase_spi_flash_sector(em100, i)) {
+			printf("\nERROR: Could not erase sector %d.\n", i);
+			free(fw);
+			return 0;
+		}
 	}
 	get_spi_flash_id(em100); // Needed?
 
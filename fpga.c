@@ -29,7 +29,7 @@ int reconfig_fpga(struct em100 *em100)
 	unsigned char cmd[16];
 	memset(cmd, 0, 16);
 	cmd[0] = 0x20; /* reconfig FPGA */
-	if (!send_cmd(em100->dev, cmd)) {
+	if (!send_cmd(em100->dev, cmd) || send_cmd_flush()) {
 		return 0;
 	}
 	/* Specification says to wait 2s before
@@ -108,7 +108,7 @@ int write_fpga_register(struct em100 *em100, int reg, int val)
 	cmd[1] = reg;
 	cmd[2] = val >> 8;
 	cmd[3] = val & 0xff;
-	if (!send_cmd(em100->dev, cmd)) {
+	if (!send_cmd(em100->dev, cmd) || send_cmd_flush()) {
 		return 0;
 	}
 	return 1;
@@ -124,7 +124,7 @@ int fpga_set_voltage(struct em100 *em100, int voltage_code)
 		cmd[2] = 7;
 		cmd[3] = 0x80;
 	}
-	if (!send_cmd(em100->dev, cmd))
+	if (!send_cmd(em100->dev, cmd) || send_cmd_flush())
 		return 0;
 
 	return 1;
@@ -146,7 +146,7 @@ int fpga_reconfigure(struct em100 *em100)
 
 	memset(cmd, '\0', 16);
 	cmd[0] = 0x20; /* Switch FPGA */
-	if (!send_cmd(em100->dev, cmd))
+	if (!send_cmd(em100->dev, cmd) || send_cmd_flush())
 		return 0;
 
 	return 1;
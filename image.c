@@ -14,6 +14,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "em100.h"
 
 enum ifd_version {
@@ -148,7 +153,7 @@ static int get_ifd_version(fcba_t *fcba, int platform)
 	default:
 		fprintf(stderr, "Unknown descriptor version: %d\n",
 			read_freq);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 }
 
@@ -226,3 +231,179 @@ int autocorrect_image(struct em100 *em100, char *image, size_t size)
 
 	return 0;
 }
+
+/* Image files
+ *
+ * Images are mapped into memory instead of being copied into a buffer,
+ * so they can be handed to the USB layer directly. Downloaded images are
+ * mapped copy-on-write, so autocorrect_image() never modifies the file.
+ * Files that can't be mapped (e.g. pipes) are read into a buffer instead.
+ */
+
+/**
+ * image_load: map an image file for reading
+ * @param image:    image to initialize
+ * @param filename: file to load
+ * @param maxlen:   maximum number of bytes to load
+ *
+ * @return: 1 on success, 0 on error. An empty file is not an error.
+ */
+int image_load(struct image *image, const char *filename, size_t maxlen)
+{
+	struct stat st;
+	ssize_t len;
+
+	image->data = NULL;
+	image->length = 0;
+	image->mapped = 0;
+	image->fd = -1;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror(filename);
+		return 0;
+	}
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		image->length = (size_t)st.st_size < maxlen ?
+				(size_t)st.st_size : maxlen;
+		if (image->length == 0) {
+			close(fd);
+			return 1;
+		}
+		image->data = mmap(NULL, image->length, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE, fd, 0);
+		if (image->data != MAP_FAILED) {
+			image->mapped = 1;
+			close(fd);
+			return 1;
+		}
+	}
+
+	/* Fall back to reading the file */
+	image->data = malloc(maxlen);
+	if (!image->data) {
+		printf("FATAL: couldn't allocate memory\n");
+		close(fd);
+		return 0;
+	}
+
+	image->length = 0;
+	while (image->length < maxlen) {
+		len = read(fd, image->data + image->length,
+				maxlen - image->length);
+		if (len < 0) {
+			perror(filename);
+			image_close(image);
+			close(fd);
+			return 0;
+		}
+		if (len == 0)
+			break;
+		image->length += len;
+	}
+	close(fd);
+
+	return 1;
+}
+
+/**
+ * image_create: create an image file that is written through memory
+ * @param image:    image to initialize
+ * @param filename: file to create
+ * @param length:   size of the file
+ *
+ * @return: 1 on success, 0 on error. The file is complete after
+ *          image_close() returned successfully.
+ *
+ * The space for a mapped file is allocated up front, so running out of
+ * disk space is reported here rather than as SIGBUS while writing.
+ */
+int image_create(struct image *image, const char *filename, size_t length)
+{
+	struct stat st;
+	int err;
+
+	image->data = NULL;
+	image->length = length;
+	image->mapped = 0;
+
+	image->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (image->fd < 0) {
+		perror(filename);
+		return 0;
+	}
+
+	if (!fstat(image->fd, &st) && S_ISREG(st.st_mode) && length) {
+		err = posix_fallocate(image->fd, 0, length);
+		if (err) {
+			printf("%s: %s\n", filename, strerror(err));
+			close(image->fd);
+			image->fd = -1;
+			return 0;
+		}
+		image->data = mmap(NULL, length, PROT_READ | PROT_WRITE,
+				MAP_SHARED, image->fd, 0);
+		if (image->data != MAP_FAILED) {
+			/* keep fd, image_close() syncs through it */
+			image->mapped = 1;
+			return 1;
+		}
+	}
+
+	/* Fall back to writing a buffer on close */
+	image->data = malloc(length);
+	if (!image->data) {
+		printf("FATAL: couldn't allocate memory\n");
+		close(image->fd);
+		image->fd = -1;
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * image_close: release an image, writing it out if it was created
+ * @param image: image to release
+ *
+ * @return: 1 on success, 0 if writing the image failed.
+ */
+int image_close(struct image *image)
+{
+	int ok = 1;
+
+	if (image->mapped) {
+		/* Only created images are shared mappings with an fd */
+		if (image->fd >= 0) {
+			if (msync(image->data, image->length, MS_SYNC)) {
+				perror("msync");
+				ok = 0;
+			}
+			if (close(image->fd))
+				ok = 0;
+		}
+		munmap(image->data, image->length);
+	} else {
+		if (image->fd >= 0) {
+			size_t written = 0;
+
+			while (ok && written < image->length) {
+				ssize_t len = write(image->fd,
+						image->data + written,
+						image->length - written);
+				if (len <= 0)
+					ok = 0;
+				else
+					written += len;
+			}
+			if (close(image->fd))
+				ok = 0;
+		}
+		free(image->data);
+	}
+
+	image->data = NULL;
+	image->fd = -1;
+	return ok;
+}
@@ -0,0 +1,316 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "em100.h"
+#include "xz.h"
+
+/* SDRAM content manifest
+ * ======================
+ *
+ * To speed up iterative development, em100 can remember what it last
+ * downloaded into a device and only send the blocks that changed since.
+ * The manifest is kept per device in $EM100_HOME/sdram-EMxxxxxx.manifest
+ *
+ *  0x0000000: 45 4d 31 30 30 4d 41 4e     - magic "EM100MAN" (8 bytes)
+ *  0x0000008: 01 00 00 00                 - version          (4 bytes)
+ *  0x000000c: 00 10 00 00                 - block size       (4 bytes)
+ *  0x0000010: 00 00 00 02                 - image length     (4 bytes)
+ *  0x0000014: 2a 00 00 00                 - serial number    (4 bytes)
+ *  0x0000018: CRC64 of each block                            (8 bytes each)
+ *
+ * All values are little endian. The device loses its SDRAM content on a
+ * power cycle, and other tools or the target may write to it, so up to
+ * MANIFEST_CHECK_BLOCKS unchanged blocks, spread over the image, are read
+ * back and checked before the manifest is trusted. Changes confined to
+ * other blocks go unnoticed; -v catches those.
+ */
+
+#define MANIFEST_MAGIC		"EM100MAN"
+#define MANIFEST_VERSION	1
+#define MANIFEST_HEADER_SIZE	0x18
+#define MANIFEST_BLOCK_SIZE	4096
+#define MANIFEST_CHECK_BLOCKS	32
+
+static uint32_t get_le32(const unsigned char *in)
+{
+	return (in[3] << 24) | (in[2] << 16) | (in[1] << 8) | (in[0] << 0);
+}
+
+static void put_le32(unsigned char *out, uint32_t val)
+{
+	out[0] = val&0xff;
+	out[1] = (val>>8)&0xff;
+	out[2] = (val>>16)&0xff;
+	out[3] = (val>>24)&0xff;
+}
+
+static char *manifest_name(struct em100 *em100)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "sdram-EM%06u.manifest",
+			em100->serialno);
+	return get_em100_file(name);
+}
+
+static unsigned int block_count(unsigned int length)
+{
+	return (length + MANIFEST_BLOCK_SIZE - 1) / MANIFEST_BLOCK_SIZE;
+}
+
+static unsigned int block_length(unsigned int block, unsigned int length)
+{
+	unsigned int left = length - block * MANIFEST_BLOCK_SIZE;
+
+	return left < MANIFEST_BLOCK_SIZE ? left : MANIFEST_BLOCK_SIZE;
+}
+
+static uint64_t *hash_image(const unsigned char *data, unsigned int length)
+{
+	unsigned int i, blocks = block_count(length);
+	uint64_t *hashes = malloc(blocks * sizeof(uint64_t));
+
+	if (!hashes) {
+		printf("Out of memory.\n");
+		return NULL;
+	}
+
+	xz_crc64_init();
+	for (i = 0; i < blocks; i++)
+		hashes[i] = xz_crc64(data + i * MANIFEST_BLOCK_SIZE,
+				block_length(i, length), 0);
+
+	return hashes;
+}
+
+/*
+ * Returns the block hashes of the last download if they describe an
+ * image of the same length on the same device, otherwise NULL.
+ */
+static uint64_t *load_manifest(struct em100 *em100, unsigned int length)
+{
+	unsigned char header[MANIFEST_HEADER_SIZE];
+	unsigned char raw[8];
+	unsigned int i, blocks = block_count(length);
+	uint64_t *hashes;
+	char *name = manifest_name(em100);
+	FILE *f = fopen(name, "rb");
+
+	free(name);
+	if (!f)
+		return NULL;
+
+	if (fread(header, MANIFEST_HEADER_SIZE, 1, f) != 1 ||
+			memcmp(header, MANIFEST_MAGIC, 8) ||
+			get_le32(header + 0x08) != MANIFEST_VERSION ||
+			get_le32(header + 0x0c) != MANIFEST_BLOCK_SIZE ||
+			get_le32(header + 0x10) != length ||
+			get_le32(header + 0x14) != em100->serialno) {
+		fclose(f);
+		return NULL;
+	}
+
+	hashes = malloc(blocks * sizeof(uint64_t));
+	if (!hashes) {
+		fclose(f);
+		return NULL;
+	}
+
+	for (i = 0; i < blocks; i++) {
+		if (fread(raw, sizeof(raw), 1, f) != 1) {
+			free(hashes);
+			fclose(f);
+			return NULL;
+		}
+		hashes[i] = (uint64_t)get_le32(raw + 4) << 32 | get_le32(raw);
+	}
+	fclose(f);
+
+	return hashes;
+}
+
+static void save_manifest(struct em100 *em100, const uint64_t *hashes,
+		unsigned int length)
+{
+	unsigned char header[MANIFEST_HEADER_SIZE];
+	unsigned char raw[8];
+	unsigned int i, blocks = block_count(length);
+	char *name = manifest_name(em100);
+	FILE *f = fopen(name, "wb");
+
+	if (!f) {
+		perror(name);
+		free(name);
+		return;
+	}
+
+	memcpy(header, MANIFEST_MAGIC, 8);
+	put_le32(header + 0x08, MANIFEST_VERSION);
+	put_le32(header + 0x0c, MANIFEST_BLOCK_SIZE);
+	put_le32(header + 0x10, length);
+	put_le32(header + 0x14, em100->serialno);
+
+	int ok = fwrite(header, MANIFEST_HEADER_SIZE, 1, f) == 1;
+	for (i = 0; ok && i < blocks; i++) {
+		put_le32(raw, hashes[i] & 0xffffffff);
+		put_le32(raw + 4, hashes[i] >> 32);
+		ok = fwrite(raw, sizeof(raw), 1, f) == 1;
+	}
+
+	if (fclose(f) || !ok) {
+		printf("Could not write %s\n", name);
+		unlink(name);
+	}
+	free(name);
+}
+
+/**
+ * manifest_invalidate: forget what was downloaded into the device
+ * @param em100: initialized em100 device structure
+ *
+ * Must be called whenever the SDRAM is written behind the manifest's back.
+ */
+void manifest_invalidate(struct em100 *em100)
+{
+	char *name = manifest_name(em100);
+
+	unlink(name);
+	free(name);
+}
+
+/* Check that a block still holds what the manifest claims it does */
+static int check_block(struct em100 *em100, unsigned int block,
+		unsigned int length, uint64_t hash)
+{
+	unsigned char data[MANIFEST_BLOCK_SIZE];
+	unsigned int len = block_length(block, length);
+
+	if (!read_sdram(em100, data, block * MANIFEST_BLOCK_SIZE, len))
+		return 0;
+
+	return xz_crc64(data, len, 0) == hash;
+}
+
+/*
+ * Read back up to MANIFEST_CHECK_BLOCKS of the clean blocks, evenly spread
+ * from the first to the last one.
+ */
+static int check_clean_blocks(struct em100 *em100, const uint64_t *old,
+		const uint64_t *hashes, unsigned int length, unsigned int clean)
+{
+	unsigned int i, n = 0, checks, blocks = block_count(length);
+	unsigned int next = 0, k = 0;
+
+	checks = clean < MANIFEST_CHECK_BLOCKS ? clean : MANIFEST_CHECK_BLOCKS;
+
+	for (i = 0; i < blocks && k < checks; i++) {
+		if (old[i] != hashes[i])
+			continue;
+		if (n++ != next)
+			continue;
+		if (!check_block(em100, i, length, old[i]))
+			return 0;
+		k++;
+		if (checks > 1)
+			next = (uint64_t)k * (clean - 1) / (checks - 1);
+	}
+	return 1;
+}
+
+/**
+ * write_sdram_incremental: download only the blocks that changed
+ * @param em100:  initialized em100 device structure
+ * @param data:   image to download to address 0
+ * @param length: length of image
+ *
+ * Falls back to downloading the whole image if there is no usable
+ * manifest for the device, or if the SDRAM content does not match it.
+ */
+int write_sdram_incremental(struct em100 *em100, unsigned char *data,
+		unsigned int length)
+{
+	unsigned int i, blocks = block_count(length);
+	unsigned int dirty = 0, ranges = 0;
+	uint64_t *hashes, *old;
+	int done = 1;
+
+	hashes = hash_image(data, length);
+	if (!hashes)
+		return 0;
+
+	old = load_manifest(em100, length);
+	if (old) {
+		for (i = 0; i < blocks; i++)
+			if (old[i] != hashes[i])
+				dirty++;
+
+		/* Make sure the device was not power cycled or rewritten */
+		if (!check_clean_blocks(em100, old, hashes, length,
+					blocks - dirty)) {
+			printf("SDRAM content does not match last download.\n");
+			free(old);
+			old = NULL;
+		}
+	}
+
+	if (!old) {
+		printf("Incremental download: downloading full image.\n");
+		manifest_invalidate(em100);
+		done = write_sdram(em100, data, 0x00000000, length);
+		if (done)
+			save_manifest(em100, hashes, length);
+		free(hashes);
+		return done;
+	}
+
+	if (!dirty) {
+		printf("Incremental download: SDRAM content up to date.\n");
+		free(old);
+		free(hashes);
+		return 1;
+	}
+
+	/* Don't leave a manifest behind if we're interrupted. */
+	manifest_invalidate(em100);
+
+	for (i = 0; done && i < blocks; i++) {
+		unsigned int start = i, end;
+
+		if (old[i] == hashes[i])
+			continue;
+		while (i < blocks && old[i] != hashes[i])
+			i++;
+		end = i * MANIFEST_BLOCK_SIZE < length ?
+				i * MANIFEST_BLOCK_SIZE : length;
+
+		done = write_sdram(em100, data + start * MANIFEST_BLOCK_SIZE,
+				start * MANIFEST_BLOCK_SIZE,
+				end - start * MANIFEST_BLOCK_SIZE);
+		ranges++;
+	}
+
+	printf("Incremental download: %u of %u blocks changed in %u "
+			"range%s.\n", dirty, blocks, ranges, ranges == 1 ? "" : "s");
+
+	if (done)
+		save_manifest(em100, hashes, length);
+
+	free(old);
+	free(hashes);
+	return done;
+}
@@ -12,6 +12,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "em100.h"
 
@@ -66,14 +67,16 @@ int read_sdram(struct em100 *em100, void *data, int address, int length)
 	return (bytes_read == length);
 }
 
-int write_sdram(struct em100 *em100, unsigned char *data, int address,
-		int length)
+/*
+ * Host-to-EM100 transfers are split into chunks of SDRAM_TRANSFER_LENGTH
+ * bytes, and up to SDRAM_TRANSFERS_INFLIGHT of them are kept in flight
+ * so the host is never idle while a chunk is on the wire.
+ */
+#define SDRAM_TRANSFER_LENGTH		0x200000
+#define SDRAM_TRANSFERS_INFLIGHT	4
+
+static int start_sdram_write(struct em100 *em100, int address, int length)
 {
-	int actual;
-	int transfer_length = 0x200000;
-	int bytes_sent=0;
-	int bytes_left;
-	int bytes_to_send;
 	unsigned char cmd[16];
 
 	memset(cmd, 0, 16);
@@ -91,27 +94,242 @@ int write_sdram(struct em100 *em100, unsigned char *data, int address,
 		printf("error initiating host-to-em100 transfer.\n");
 		return 0;
 	}
+	return 1;
+}
 
-	while ( bytes_sent < length) {
-		actual = 0;
+/* Wait for the oldest chunk in flight and account for it. */
+static int finish_sdram_chunk(struct usb_request *req, int *bytes_sent,
+		int length)
+{
+	usb_wait(req);
+
+	*bytes_sent += req->actual;
+	if (req->actual < req->length) {
+		printf("Tried sending %d bytes, sent %d\n",
+				req->length, req->actual);
+		return 0;
+	}
+
+	printf("Sent %d bytes of %d\n", *bytes_sent, length);
+	return 1;
+}
+
+int write_sdram(struct em100 *em100, unsigned char *data, int address,
+		int length)
+{
+	struct usb_request req[SDRAM_TRANSFERS_INFLIGHT];
+	int bytes_sent = 0;
+	int bytes_queued = 0;
+	int bytes_to_send;
+	unsigned int head = 0, tail = 0;
+	int ok = 1;
+
+	if (!start_sdram_write(em100, address, length))
+		return 0;
+
+	memset(req, 0, sizeof(req));
+
+	while (ok && bytes_sent < length) {
+		/* Fill up the pipeline */
+		while (bytes_queued < length &&
+				head - tail < SDRAM_TRANSFERS_INFLIGHT) {
+			struct usb_request *r =
+				&req[head % SDRAM_TRANSFERS_INFLIGHT];
+
+			bytes_to_send = length - bytes_queued;
+			if (bytes_to_send > SDRAM_TRANSFER_LENGTH)
+				bytes_to_send = SDRAM_TRANSFER_LENGTH;
+
+			r->endpoint = 1 | LIBUSB_ENDPOINT_OUT;
+			r->buffer = data + bytes_queued;
+			r->length = bytes_to_send;
+			usb_submit(r);
+
+			bytes_queued += bytes_to_send;
+			head++;
+		}
+
+		ok = finish_sdram_chunk(&req[tail % SDRAM_TRANSFERS_INFLIGHT],
+				&bytes_sent, length);
+		tail++;
+	}
+
+	/* Don't leave requests behind that point to our stack */
+	while (tail != head)
+		usb_wait(&req[tail++ % SDRAM_TRANSFERS_INFLIGHT]);
+
+	/* The 0x40 command was only queued, make sure it arrived */
+	ok = !send_cmd_flush() && bytes_sent == length;
+
+	printf ("Transfer %s\n", ok ? "Succeeded" : "Failed");
+	return ok;
+}
+
+/*
+ * Partial writes are done in units of SDRAM_WRITE_ALIGN bytes. Unaligned
+ * edges are merged with the current SDRAM content, so only the blocks
+ * at the start and end of the range need to be read back.
+ */
+#define SDRAM_WRITE_ALIGN	512
+
+static int write_sdram_edge(struct em100 *em100, unsigned char *data,
+		int address, int length)
+{
+	unsigned char block[SDRAM_WRITE_ALIGN];
+	int start = address & ~(SDRAM_WRITE_ALIGN - 1);
+
+	if (!read_sdram(em100, block, start, SDRAM_WRITE_ALIGN)) {
+		printf("Error: sdram readback failed\n");
+		return 0;
+	}
+	memcpy(block + (address - start), data, length);
+
+	return write_sdram(em100, block, start, SDRAM_WRITE_ALIGN);
+}
 
-		bytes_left = length - bytes_sent;
-		bytes_to_send = (bytes_left < transfer_length) ? bytes_left :
-				transfer_length;
-
-		libusb_bulk_transfer(em100->dev, 1 | LIBUSB_ENDPOINT_OUT,
-			data + bytes_sent, bytes_to_send, &actual,
-			BULK_SEND_TIMEOUT);
-		bytes_sent += actual;
-		if (actual < bytes_to_send) {
-			printf("Tried sending %d bytes, sent %d\n",
-					bytes_to_send, actual);
+/**
+ * write_sdram_range: write an arbitrary range of SDRAM
+ * @param em100:   initialized em100 device structure
+ * @param data:    data to write
+ * @param address: SDRAM destination address
+ * @param length:  number of bytes to write
+ *
+ * Everything outside of [address, address + length) is preserved.
+ */
+int write_sdram_range(struct em100 *em100, unsigned char *data, int address,
+		int length)
+{
+	int head = address & (SDRAM_WRITE_ALIGN - 1);
+	int len;
+
+	if (head) {
+		len = SDRAM_WRITE_ALIGN - head;
+		if (len > length)
+			len = length;
+		if (!write_sdram_edge(em100, data, address, len))
+			return 0;
+		data += len;
+		address += len;
+		length -= len;
+	}
+
+	len = length & ~(SDRAM_WRITE_ALIGN - 1);
+	if (len) {
+		if (!write_sdram(em100, data, address, len))
+			return 0;
+		data += len;
+		address += len;
+		length -= len;
+	}
+
+	if (length && !write_sdram_edge(em100, data, address, length))
+		return 0;
+
+	return 1;
+}
+
+/**
+ * verify_sdram: compare SDRAM content with a buffer
+ * @param em100:   initialized em100 device structure
+ * @param data:    expected content
+ * @param address: SDRAM address to compare from
+ * @param length:  number of bytes to compare
+ *
+ * A single read command covers the whole range, and its data is received
+ * in chunks with several transfers in flight, each chunk being compared
+ * as it arrives. Only the first mismatch is reported; the rest of the
+ * data is still drained so no stale data is left on the endpoint.
+ */
+int verify_sdram(struct em100 *em100, unsigned char *data, int address,
+		int length)
+{
+	struct usb_request req[SDRAM_TRANSFERS_INFLIGHT];
+	unsigned char *buffer[SDRAM_TRANSFERS_INFLIGHT];
+	unsigned char cmd[16];
+	int bytes_queued = 0, bytes_verified = 0;
+	int chunk, offset, i;
+	unsigned int head = 0, tail = 0;
+	int match = 1, ok = 1;
+
+	memset(req, 0, sizeof(req));
+	for (i = 0; i < SDRAM_TRANSFERS_INFLIGHT; i++) {
+		buffer[i] = malloc(SDRAM_TRANSFER_LENGTH);
+		if (!buffer[i]) {
+			printf("FATAL: couldn't allocate memory\n");
+			while (i--)
+				free(buffer[i]);
+			return 0;
+		}
+	}
+
+	memset(cmd, 0, 16);
+	cmd[0] = 0x41; /* em100-to-host eeprom data */
+	cmd[1] = (address >> 24) & 0xff;
+	cmd[2] = (address >> 16) & 0xff;
+	cmd[3] = (address >> 8) & 0xff;
+	cmd[4] = address & 0xff;
+	cmd[5] = (length >> 24) & 0xff;
+	cmd[6] = (length >> 16) & 0xff;
+	cmd[7] = (length >> 8) & 0xff;
+	cmd[8] = length & 0xff;
+
+	if (!send_cmd(em100->dev, cmd)) {
+		printf("error initiating em100-to-host transfer.\n");
+		ok = 0;
+	}
+
+	while (ok && bytes_verified < length) {
+		/* Fill up the pipeline */
+		while (bytes_queued < length &&
+				head - tail < SDRAM_TRANSFERS_INFLIGHT) {
+			struct usb_request *r =
+				&req[head % SDRAM_TRANSFERS_INFLIGHT];
+
+			chunk = length - bytes_queued;
+			if (chunk > SDRAM_TRANSFER_LENGTH)
+				chunk = SDRAM_TRANSFER_LENGTH;
+
+			r->endpoint = 2 | LIBUSB_ENDPOINT_IN;
+			r->buffer = buffer[head % SDRAM_TRANSFERS_INFLIGHT];
+			r->length = chunk;
+			usb_submit(r);
+
+			bytes_queued += chunk;
+			head++;
+		}
+
+		struct usb_request *r = &req[tail % SDRAM_TRANSFERS_INFLIGHT];
+		usb_wait(r);
+		tail++;
+
+		if (r->actual < r->length) {
+			printf("tried reading %d bytes, got %d\n",
+					r->length, r->actual);
+			ok = 0;
 			break;
 		}
 
-		printf("Sent %d bytes of %d\n", bytes_sent, length);
+		if (match && memcmp(r->buffer, data + bytes_verified,
+					r->length)) {
+			for (offset = 0; r->buffer[offset] ==
+					data[bytes_verified + offset]; offset++)
+				;
+			printf("Mismatch at 0x%08x: expected 0x%02x, "
+					"got 0x%02x\n",
+					address + bytes_verified + offset,
+					data[bytes_verified + offset],
+					r->buffer[offset]);
+			match = 0;
+		}
+		bytes_verified += r->length;
 	}
 
-	printf ("Transfer %s\n",bytes_sent == length ? "Succeeded" : "Failed");
-	return (bytes_sent == length);
+	/* Don't leave requests behind that point to our buffers */
+	while (tail != head)
+		usb_wait(&req[tail++ % SDRAM_TRANSFERS_INFLIGHT]);
+
+	for (i = 0; i < SDRAM_TRANSFERS_INFLIGHT; i++)
+		free(buffer[i]);
+
+	return ok && match && bytes_verified == length;
 }
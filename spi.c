@@ -40,7 +40,7 @@ int erase_spi_flash(struct em100 *em100)
 	unsigned char cmd[16];
 	memset(cmd, 0, 16);
 	cmd[0] = 0x31; /* Erase SPI flash */
-	if (!send_cmd(em100->dev, cmd)) {
+	if (!send_cmd(em100->dev, cmd) || send_cmd_flush()) {
 		return 0;
 	}
 	/* Specification says to wait 5s before
@@ -130,10 +130,13 @@ int write_spi_flash_page(struct em100 *em100, int address, unsigned char *data)
 		}
 	}
 
-	if (bytes_sent != length)
+	/* the command was only queued, make sure it arrived */
+	if (send_cmd_flush() || bytes_sent != length) {
 		printf ("SPI transfer failed\n");
+		return 0;
+	}
 
-	return (bytes_sent == length);
+	return 1;
 }
 
 int unlock_spi_flash(struct em100 *em100)
@@ -141,7 +144,7 @@ int unlock_spi_flash(struct em100 *em100)
 	unsigned char cmd[16];
 	memset(cmd, 0, 16);
 	cmd[0] = 0x36; /* Unlock SPI flash */
-	if (!send_cmd(em100->dev, cmd)) {
+	if (!send_cmd(em100->dev, cmd) || send_cmd_flush()) {
 		return 0;
 	}
 	/* Specification says to wait 5s before
@@ -166,7 +169,7 @@ int erase_spi_flash_sector(struct em100 *em100, unsigned int sector)
 	memset(cmd, 0, 16);
 	cmd[0] = 0x37; /* Erase SPI flash sector */
 	cmd[1] = sector;
-	if (!send_cmd(em100->dev, cmd)) {
+	if (!send_cmd(em100->dev, cmd) || send_cmd_flush()) {
 		return 0;
 	}
 	/* Specification says to wait 5s before
@@ -234,7 +237,7 @@ int write_ht_register(struct em100 *em100, int reg, uint8_t val)
 	cmd[0] = 0x51; /* write fpga registers */
 	cmd[1] = reg;
 	cmd[2] = val;
-	if (!send_cmd(em100->dev, cmd)) {
+	if (!send_cmd(em100->dev, cmd) || send_cmd_flush()) {
 		return 0;
 	}
 	return 1;
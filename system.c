@@ -58,7 +58,7 @@ int set_voltage(struct em100 *em100, set_voltage_channel_t channel, int mV)
 	cmd[1] = channel;
 	cmd[2] = mV >> 8;
 	cmd[3] = mV & 0xff;
-	if (!send_cmd(em100->dev, cmd)) {
+	if (!send_cmd(em100->dev, cmd) || send_cmd_flush()) {
 		return 0;
 	}
 	return 1;
@@ -103,7 +103,7 @@ int set_led(struct em100 *em100, led_state_t led_state)
 	memset(cmd, 0, 16);
 	cmd[0] = 0x13; /* set LED */
 	cmd[1] = led_state;
-	if (!send_cmd(em100->dev, cmd)) {
+	if (!send_cmd(em100->dev, cmd) || send_cmd_flush()) {
 		return 0;
 	}
 	return 1;
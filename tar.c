@@ -16,6 +16,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "em100.h"
 #include "xz.h"
@@ -56,33 +60,167 @@ static unsigned int checksum(tar_header_t *file)
 	return chksum;
 }
 
-int tar_for_each(TFILE *tfile, int (*run)(char *, TFILE *, void *, int), void *data)
+/*
+ * Member index
+ *
+ * Walking the headers means parsing octal numbers and checksumming 512
+ * bytes per member, so this is done once per archive, on first use. Each
+ * regular file is recorded in archive order, and its name is hashed
+ * (FNV-1a) into two open addressing tables, one of them case folded for
+ * case insensitive lookups. Like the walk, the index ends at the first
+ * header with a bad checksum.
+ */
+struct tar_entry {
+	char *name;
+	size_t offset;		/* of the data */
+	size_t size;
+	int ok;			/* header checksum is valid */
+};
+
+struct tar_index {
+	struct tar_entry *entries;
+	size_t count;
+	uint32_t *exact;	/* entry + 1, 0 if the slot is free */
+	uint32_t *folded;
+	size_t mask;
+};
+
+static uint32_t hash_name(const char *name, int fold)
+{
+	uint32_t hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < 100 && name[i]; i++) {
+		unsigned char c = name[i];
+
+		if (fold && c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		hash = (hash ^ c) * 16777619U;
+	}
+	return hash;
+}
+
+static int same_name(const char *a, const char *b, int fold)
+{
+	return fold ? !strncasecmp(a, b, 100) : !strncmp(a, b, 100);
+}
+
+static void index_insert(struct tar_index *index, uint32_t *table, size_t n,
+		int fold)
 {
-	size_t i = 0;
+	const char *name = index->entries[n].name;
+	size_t slot = hash_name(name, fold) & index->mask;
+
+	for (; table[slot]; slot = (slot + 1) & index->mask) {
+		/* the first member of a name wins, like in a linear search */
+		if (same_name(index->entries[table[slot] - 1].name, name, fold))
+			return;
+	}
+	table[slot] = n + 1;
+}
+
+static void free_index(struct tar_index *index)
+{
+	if (!index)
+		return;
+	free(index->entries);
+	free(index->exact);
+	free(index->folded);
+	free(index);
+}
+
+static struct tar_index *get_index(TFILE *tfile)
+{
+	struct tar_index *index;
+	size_t i = 0, n, size = 0, slots = 16;
+
+	if (tfile->index)
+		return tfile->index;
+
+	index = calloc(1, sizeof(*index));
+	if (!index) {
+		printf("Out of memory.\n");
+		return NULL;
+	}
 
-	while (i < tfile->length) {
+	while (i + sizeof(tar_header_t) <= tfile->length) {
 		tar_header_t *f = (tar_header_t *)(tfile->address + i);
 		/* null header at end of tar */
 		if (f->name[0] == 0)
 			break;
 
-		unsigned int size = strtol(f->size, NULL, 8);
+		unsigned int fsize = strtol(f->size, NULL, 8);
 		unsigned int cksum = strtol(f->checksum, NULL, 8);
 		unsigned int ok = (checksum(f) == cksum);
 
 		if (f->type == '0') {
-			TFILE s;
-			s.address = tfile->address + i + sizeof(tar_header_t);
-			s.length = size;
-			s.alloc = 0;
-
-			if ((*run)(f->name, &s, data, ok))
-				break;
+			if (index->count == size) {
+				struct tar_entry *e;
+
+				size = size ? size * 2 : 64;
+				e = realloc(index->entries, size * sizeof(*e));
+				if (!e) {
+					printf("Out of memory.\n");
+					free_index(index);
+					return NULL;
+				}
+				index->entries = e;
+			}
+			index->entries[index->count].name = f->name;
+			index->entries[index->count].offset =
+					i + sizeof(tar_header_t);
+			index->entries[index->count].size = fsize;
+			index->entries[index->count].ok = ok;
+			index->count++;
 		}
 
 		if (!ok)
 			break;
-		i += sizeof(tar_header_t) + ROUND_UP(size, 512);
+		i += sizeof(tar_header_t) + ROUND_UP(fsize, 512);
+	}
+
+	while (slots < 2 * index->count)
+		slots *= 2;
+	index->mask = slots - 1;
+	index->exact = calloc(slots, sizeof(*index->exact));
+	index->folded = calloc(slots, sizeof(*index->folded));
+	if (!index->exact || !index->folded) {
+		printf("Out of memory.\n");
+		free_index(index);
+		return NULL;
+	}
+
+	for (n = 0; n < index->count; n++) {
+		/* tar_find() never returned members with a bad header */
+		if (!index->entries[n].ok)
+			continue;
+		index_insert(index, index->exact, n, 0);
+		index_insert(index, index->folded, n, 1);
+	}
+
+	tfile->index = index;
+	return index;
+}
+
+int tar_for_each(TFILE *tfile, int (*run)(char *, TFILE *, void *, int), void *data)
+{
+	struct tar_index *index = get_index(tfile);
+	size_t n;
+
+	if (!index)
+		return 0;
+
+	for (n = 0; n < index->count; n++) {
+		struct tar_entry *e = &index->entries[n];
+		TFILE s;
+
+		s.address = tfile->address + e->offset;
+		s.length = e->size;
+		s.alloc = TFILE_BORROWED;
+		s.index = NULL;
+
+		if ((*run)(e->name, &s, data, e->ok))
+			break;
 	}
 
 	return 0;
@@ -102,186 +240,536 @@ int tar_ls(TFILE *tfile)
 
 TFILE *tar_find(TFILE *tfile, const char *name, int casesensitive)
 {
-	size_t i = 0;
+	struct tar_index *index = get_index(tfile);
+	int fold = !casesensitive;
+	uint32_t *table;
+	size_t slot;
 	TFILE *ret;
 
-	while (i < tfile->length) {
-		tar_header_t *f = (tar_header_t *)(tfile->address + i);
-		if (f->name[0] == 0) /* null header at end of tar */
-			break;
+	if (!index)
+		return NULL;
 
-		unsigned int size = strtol(f->size, NULL, 8);
-		unsigned int cksum = strtol(f->checksum, NULL, 8);
-		unsigned int ok = (checksum(f) == cksum);
+	table = fold ? index->folded : index->exact;
+	for (slot = hash_name(name, fold) & index->mask; table[slot];
+			slot = (slot + 1) & index->mask) {
+		struct tar_entry *e = &index->entries[table[slot] - 1];
 
-		if (!ok)
-			break;
+		if (!same_name(name, e->name, fold))
+			continue;
 
-		int compare = casesensitive ? strncmp(name, f->name, 100) :
-				strncasecmp(name, f->name, 100);
-		if (!compare && f->type == '0') {
-			ret = (TFILE *)malloc(sizeof(TFILE));
-			if (!ret) {
-				perror("Out of memory.\n");
-				return NULL;
-			}
+		ret = (TFILE *)malloc(sizeof(TFILE));
+		if (!ret) {
+			perror("Out of memory.\n");
+			return NULL;
+		}
 
-			ret->address = tfile->address + i + sizeof(tar_header_t);
-			ret->length = size;
-			ret->alloc = 0;
+		ret->address = tfile->address + e->offset;
+		ret->length = e->size;
+		ret->alloc = TFILE_BORROWED;
+		ret->index = NULL;
 
-			return ret;
-		}
-		i += sizeof(tar_header_t) + ROUND_UP(size, 512);
+		return ret;
 	}
 
 	return NULL;
 }
 
-/* Finding the uncompressed size of an archive should really be part
- * of the xz API.
+/*
+ * Streaming decompression
+ *
+ * Archives are decompressed in multi-call mode, XZ_CHUNK bytes of input
+ * and output at a time, with a dictionary allocated as large as the
+ * stream needs. The output goes to a consumer that may stop early, so a
+ * member can be extracted without decompressing or holding the rest of
+ * the archive. Any number of blocks, and concatenated streams with
+ * padding in between, are handled.
+ *
+ * Output is handed out before the integrity check of its block has been
+ * verified. Only a return value of 1 says that the whole file decoded
+ * and every check passed; stopping early never counts as success, and
+ * checks the decoder can't verify are rejected like before streaming.
  */
-static uint32_t decode_vli(unsigned char **streamptr)
-{
-	unsigned char *stream = *streamptr;
-	uint32_t val = 0;
-	int pos = 0;
-
-	val = *stream & 0x7f;
-	do {
-		pos += 7;
-		stream++;
-		val |= ((uint32_t)*stream & 0x7f) << pos;
-	} while (stream[0] & 0x80);
-	*streamptr = stream+1;
-
-	return val;
-}
+#define XZ_CHUNK	(64 * 1024)
+#define XZ_DICT_MAX	(64 MB)
 
-static uint32_t uncompressed_size(unsigned char *stream, size_t length)
+static int xz_stream(const char *filename,
+		int (*consume)(const unsigned char *, size_t, void *), void *data)
 {
-	if (stream[length-2] != 0x59 || stream[length-1] != 0x5a) {
-		printf("Bad stream footer.\n");
+	unsigned char *in, *out;
+	struct xz_buf b;
+	struct xz_dec *s;
+	enum xz_ret ret;
+	int in_stream = 1, eof = 0, result = 0;
+	size_t padding = 0;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		perror(filename);
 		return 0;
 	}
-	unsigned char *bytes = stream + length - 8;
-	uint32_t backward_size =
-		bytes[0] | (bytes[1]<<8) | (bytes[2]<<16) | (bytes[3]<<24);
-	backward_size = (backward_size + 1) << 2;
-	bytes = stream + length - 12 /* stream footer */ - backward_size;
-	if (bytes[0] != 0x00) {
-		printf("Bad index indicator.\n");
-		return 0;
+
+	xz_crc32_init();
+#ifdef XZ_USE_CRC64
+	xz_crc64_init();
+#endif
+	s = xz_dec_init(XZ_DYNALLOC, XZ_DICT_MAX);
+	in = malloc(XZ_CHUNK);
+	out = malloc(XZ_CHUNK);
+	if (!s || !in || !out) {
+		printf("Decompression init failed.\n");
+		goto out;
 	}
-	if (bytes[1] != 0x01) {
-		printf("More than one index. I'm confused.\n");
-		return 0;
+
+	b.in = in;
+	b.in_pos = 0;
+	b.in_size = 0;
+	b.out = out;
+	b.out_pos = 0;
+	b.out_size = XZ_CHUNK;
+
+	for (;;) {
+		if (b.in_pos == b.in_size && !eof) {
+			b.in_size = fread(in, 1, XZ_CHUNK, f);
+			b.in_pos = 0;
+			if (ferror(f)) {
+				perror(filename);
+				goto out;
+			}
+			eof = !b.in_size;
+		}
+
+		if (!in_stream) {
+			/* Stream Padding is a multiple of 4 null bytes */
+			while (b.in_pos < b.in_size && !in[b.in_pos]) {
+				b.in_pos++;
+				padding++;
+			}
+			if (b.in_pos == b.in_size && !eof)
+				continue;
+			if (padding % 4) {
+				printf("Bad stream padding.\n");
+				goto out;
+			}
+			if (eof) {
+				result = 1;
+				goto out;
+			}
+			xz_dec_reset(s);
+			in_stream = 1;
+			padding = 0;
+		}
+
+		ret = xz_dec_run(s, &b);
+
+		if (b.out_pos) {
+			/* the rest is unchecked, so this is not a success */
+			if (consume(out, b.out_pos, data))
+				goto out;
+			b.out_pos = 0;
+		}
+
+		if (ret == XZ_STREAM_END) {
+			in_stream = 0;
+		} else if (ret == XZ_UNSUPPORTED_CHECK) {
+			printf("Unsupported integrity check.\n");
+			goto out;
+		} else if (ret != XZ_OK) {
+			break;
+		}
 	}
-	bytes += 2;
 
-	/* skip unpadded size */
-	decode_vli(&bytes);
-	return decode_vli(&bytes);
+	printf("Decompression failed.\n");
+out:
+	xz_dec_end(s);
+	free(in);
+	free(out);
+	fclose(f);
+	return result;
+}
+
+struct tar_buffer {
+	unsigned char *address;
+	size_t length, size;
+	int failed;
+};
+
+static int append(const unsigned char *buf, size_t len, void *data)
+{
+	struct tar_buffer *tar = data;
+
+	if (tar->length + len > tar->size) {
+		size_t size = tar->size ? tar->size : 1 MB;
+		unsigned char *p;
+
+		while (size < tar->length + len)
+			size *= 2;
+		p = realloc(tar->address, size);
+		if (!p) {
+			printf("Out of memory.\n");
+			tar->failed = 1;
+			return 1;
+		}
+		tar->address = p;
+		tar->size = size;
+	}
 
+	memcpy(tar->address + tar->length, buf, len);
+	tar->length += len;
 	return 0;
 }
 
 TFILE *tar_load_compressed(char *filename)
 {
-	FILE *f;
-	long cfsize, fsize;
-	unsigned char *cfw, *fw;
-
-	/* Load our file into memory */
+	struct tar_buffer tar = { 0 };
+	TFILE *tfile;
 
-	f = fopen(filename, "rb");
-	if (!f) {
-		perror(filename);
+	if (!xz_stream(filename, append, &tar) || tar.failed) {
+		free(tar.address);
 		return NULL;
 	}
 
-	fseek(f, 0, SEEK_END);
-	cfsize = ftell(f);
-	if (cfsize < 0) {
-		perror(filename);
-		fclose(f);
+	/* Prepare answer */
+	tfile = malloc(sizeof(TFILE));
+	if (tfile == NULL) {
+		printf("Out of memory.\n");
+		free(tar.address);
 		return NULL;
 	}
-	fseek(f, 0, SEEK_SET);
+	tfile->address = tar.address;
+	tfile->length = tar.length;
+	tfile->alloc = TFILE_MALLOC;
+	tfile->index = NULL;
 
-	cfw = malloc(cfsize);
-	if (!cfw) {
-		printf("Out of memory.\n");
-		fclose(f);
-		return NULL;
+	return tfile;
+}
+
+/*
+ * Walking a tar while it is decompressed. Headers are collected until
+ * they are complete, regular files in a buffer as large as the largest
+ * of them so far, and everything else is skipped.
+ */
+struct tar_walk {
+	int (*run)(char *, TFILE *, void *, int);
+	void *data;
+
+	tar_header_t header;
+	size_t header_len;
+	char name[sizeof(((tar_header_t *)0)->name) + 1];
+	int ok;
+
+	unsigned char *member;
+	size_t member_size;
+	size_t length, pos;	/* of the current member */
+	size_t skip;		/* bytes up to the next header */
+	int in_member;
+	int end;		/* end of tar seen, the rest is padding */
+	int failed;
+};
+
+static int walk_header(struct tar_walk *w)
+{
+	tar_header_t *f = &w->header;
+	size_t fsize;
+
+	/* null header at end of tar, keep decoding for the checks */
+	if (f->name[0] == 0) {
+		w->end = 1;
+		w->header_len = 0;
+		return 0;
 	}
-	if (fread(cfw, cfsize, 1, f) != 1) {
-		perror(filename);
-		fclose(f);
-		free(cfw);
-		return NULL;
+
+	fsize = strtol(f->size, NULL, 8);
+	w->ok = (checksum(f) == strtol(f->checksum, NULL, 8));
+	w->header_len = 0;
+	w->skip = ROUND_UP(fsize, 512);
+
+	if (f->type != '0')
+		return !w->ok;
+
+	if (fsize > w->member_size) {
+		unsigned char *p = realloc(w->member, fsize);
+
+		if (!p) {
+			printf("Out of memory.\n");
+			w->failed = 1;
+			return 1;
+		}
+		w->member = p;
+		w->member_size = fsize;
 	}
-	fclose(f);
+	memcpy(w->name, f->name, sizeof(f->name));
+	w->name[sizeof(f->name)] = '\0';
+	w->length = fsize;
+	w->pos = 0;
+	w->skip -= fsize;
+	w->in_member = 1;
+	return 0;
+}
 
-	fsize = uncompressed_size(cfw, cfsize);
-	fw = malloc(fsize);
-	if (!fw) {
-		printf("Out of memory.\n");
-		free(cfw);
-		return NULL;
+static int walk_member(struct tar_walk *w)
+{
+	TFILE s;
+
+	w->in_member = 0;
+	s.address = w->member;
+	s.length = w->length;
+	s.alloc = TFILE_BORROWED;
+	s.index = NULL;
+
+	/* like tar_for_each(), a bad header ends the walk */
+	return (*w->run)(w->name, &s, w->data, w->ok) || !w->ok;
+}
+
+static int walk(const unsigned char *buf, size_t len, void *data)
+{
+	struct tar_walk *w = data;
+
+	if (w->end)
+		return 0;
+
+	while (len || (w->in_member && w->pos == w->length)) {
+		size_t n;
+
+		if (w->in_member) {
+			n = w->length - w->pos < len ? w->length - w->pos : len;
+			memcpy(w->member + w->pos, buf, n);
+			w->pos += n;
+			if (w->pos == w->length && walk_member(w))
+				return 1;
+		} else if (w->skip) {
+			n = w->skip < len ? w->skip : len;
+			w->skip -= n;
+		} else if (w->end) {
+			break;
+		} else {
+			n = sizeof(w->header) - w->header_len < len ?
+				sizeof(w->header) - w->header_len : len;
+			memcpy((unsigned char *)&w->header + w->header_len,
+					buf, n);
+			w->header_len += n;
+			if (w->header_len == sizeof(w->header) && walk_header(w))
+				return 1;
+		}
+		buf += n;
+		len -= n;
 	}
+	return 0;
+}
 
-	/* Decompress xz */
-	struct xz_buf b;
-	struct xz_dec *s;
-	enum xz_ret ret;
+/**
+ * tar_stream: run a function for each file in a compressed tar
+ * @param filename: .tar.xz file
+ * @param run: like for tar_for_each(), return nonzero to stop
+ * @param data: passed to run
+ *
+ * Unlike tar_for_each() this never holds more than one file of the
+ * archive. The TFILE passed to run is only valid during the call, and
+ * its data is not verified yet: only keep what run collected if this
+ * returns 1, which means the whole archive decoded and its integrity
+ * checks passed. Stopping the walk early returns 0.
+ */
+int tar_stream(const char *filename, int (*run)(char *, TFILE *, void *, int),
+		void *data)
+{
+	struct tar_walk w;
+	int ret;
 
-	xz_crc32_init();
-#ifdef XZ_USE_CRC64
-	xz_crc64_init();
-#endif
-	s = xz_dec_init(XZ_SINGLE, 0);
-	if (s == NULL) {
-		printf("Decompression init failed.\n");
-		free(cfw);
-		free(fw);
+	memset(&w, 0, sizeof(w));
+	w.run = run;
+	w.data = data;
+
+	ret = xz_stream(filename, walk, &w) && !w.failed;
+	if (ret && (w.in_member || w.header_len)) {
+		printf("%s: truncated tar.\n", filename);
+		ret = 0;
+	}
+	free(w.member);
+
+	return ret;
+}
+
+/* Decompressed Archive Cache Format
+ * ==================================
+ *
+ * Decompressing configs.tar.xz takes longer than everything else em100
+ * does for a --start or --stop. So the tar is also kept uncompressed in
+ * a cache file that can be mapped right away. The cache is only used
+ * while size, mtime and CRC64 of the archive match the ones recorded in
+ * its header, otherwise it is rebuilt. Values are in host byte order;
+ * the cache never leaves the machine.
+ *
+ *  0x00: 45 4d 31 30 30 54 41 52  - magic "EM100TAR"     (8 bytes)
+ *  0x08: version                                         (4 bytes)
+ *  0x0c: reserved                                        (4 bytes)
+ *  0x10: size of the archive                             (8 bytes)
+ *  0x18: mtime of the archive                            (8 bytes)
+ *  0x20: CRC64 of the archive                            (8 bytes)
+ *  0x28: size of the tar                                 (8 bytes)
+ *  0x30: reserved                                        (16 bytes)
+ *  0x40: tar
+ */
+
+#define TAR_CACHE_MAGIC		"EM100TAR"
+#define TAR_CACHE_VERSION	1
+
+struct tar_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t archive_size;
+	uint64_t archive_mtime;
+	uint64_t archive_crc;
+	uint64_t tar_size;
+	uint64_t reserved2[2];
+};
+
+static TFILE *tar_cache_open(const char *cachename,
+		const struct tar_cache_header *want)
+{
+	struct tar_cache_header *hdr;
+	struct stat st;
+	TFILE *tfile;
+	void *map;
+	int fd;
+
+	fd = open(cachename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
 		return NULL;
 	}
 
-        b.in = cfw;
-        b.in_pos = 0;
-        b.in_size = cfsize;
-        b.out = fw;
-        b.out_pos = 0;
-        b.out_size = fsize;
-
-	ret = xz_dec_run(s, &b);
-	if (ret != XZ_STREAM_END) {
-		printf("Decompression failed.\n");
-		free(cfw);
-		free(fw);
+	/* The chip parser adjusts configs in place, so map copy on write */
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+	if (memcmp(hdr->magic, want->magic, sizeof(hdr->magic)) ||
+			hdr->version != want->version ||
+			hdr->archive_size != want->archive_size ||
+			hdr->archive_mtime != want->archive_mtime ||
+			hdr->archive_crc != want->archive_crc ||
+			hdr->tar_size != st.st_size - sizeof(*hdr)) {
+		munmap(map, st.st_size);
 		return NULL;
 	}
-	free(cfw);
 
-	/* Prepare answer */
-	TFILE *tfile = malloc(sizeof(TFILE));
-	if (tfile == NULL) {
-		printf("Out of memory.\n");
-		free(fw);
+	tfile = malloc(sizeof(TFILE));
+	if (!tfile) {
+		munmap(map, st.st_size);
 		return NULL;
 	}
-	tfile->address = fw;
-	tfile->length = fsize;
-	tfile->alloc = 1;
+	tfile->address = (unsigned char *)map + sizeof(*hdr);
+	tfile->length = hdr->tar_size;
+	tfile->alloc = TFILE_MMAP;
+	tfile->index = NULL;
+
+	return tfile;
+}
+
+static void tar_cache_write(const char *cachename,
+		struct tar_cache_header *hdr, TFILE *tfile)
+{
+	size_t len = strlen(cachename) + 5;
+	char *tmpname = malloc(len);
+	FILE *f;
+	int ok;
+
+	if (!tmpname)
+		return;
+	snprintf(tmpname, len, "%s.tmp", cachename);
+
+	f = fopen(tmpname, "wb");
+	if (!f) {
+		free(tmpname);
+		return;
+	}
+
+	hdr->tar_size = tfile->length;
+	ok = fwrite(hdr, sizeof(*hdr), 1, f) == 1 &&
+		fwrite(tfile->address, tfile->length, 1, f) == 1;
+	ok = !fclose(f) && ok;
+
+	/* Readers either see the old cache or the complete new one */
+	if (!ok || rename(tmpname, cachename))
+		unlink(tmpname);
+	free(tmpname);
+}
+
+/**
+ * tar_stamp: identify the current contents of an archive
+ * @param filename: .tar.xz file
+ * @param stamp: size, mtime and CRC64 of the file
+ *
+ * Files derived from an archive record its stamp, and are stale once
+ * the stamp changes.
+ */
+int tar_stamp(const char *filename, struct tar_stamp *stamp)
+{
+	struct image archive;
+	struct stat st;
+
+	if (stat(filename, &st)) {
+		perror(filename);
+		return 0;
+	}
+	if (!image_load(&archive, filename, st.st_size))
+		return 0;
+
+	stamp->size = st.st_size;
+	stamp->mtime = st.st_mtime;
+	xz_crc64_init();
+	stamp->crc = xz_crc64(archive.data, archive.length, 0);
+	image_close(&archive);
+
+	return 1;
+}
+
+/**
+ * tar_load_cached: load a compressed tar, through a decompressed cache
+ * @param filename: .tar.xz file
+ * @param cachename: cache of the decompressed tar, created if needed
+ */
+TFILE *tar_load_cached(char *filename, const char *cachename)
+{
+	struct tar_cache_header hdr;
+	struct tar_stamp stamp;
+	TFILE *tfile;
+
+	if (!tar_stamp(filename, &stamp))
+		return NULL;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TAR_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TAR_CACHE_VERSION;
+	hdr.archive_size = stamp.size;
+	hdr.archive_mtime = stamp.mtime;
+	hdr.archive_crc = stamp.crc;
+
+	tfile = tar_cache_open(cachename, &hdr);
+	if (tfile)
+		return tfile;
 
+	tfile = tar_load_compressed(filename);
+	if (tfile)
+		tar_cache_write(cachename, &hdr, tfile);
 	return tfile;
 }
 
 int tar_close(TFILE *tfile)
 {
-	if (tfile->alloc) {
+	free_index(tfile->index);
+	if (tfile->alloc == TFILE_MALLOC) {
 		free(tfile->address);
+	} else if (tfile->alloc == TFILE_MMAP) {
+		munmap(tfile->address - sizeof(struct tar_cache_header),
+				tfile->length + sizeof(struct tar_cache_header));
 	}
 	free(tfile);
 	return 0;
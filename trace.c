@@ -11,8 +11,13 @@
  * GNU General Public License for more details.
  */
 
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "em100.h"
 
 /* SPI Trace related operations */
@@ -28,30 +33,31 @@ int reset_spi_trace(struct em100 *em100)
 	unsigned char cmd[16];
 	memset(cmd, 0, 16);
 	cmd[0] = 0xbd; /* reset SPI trace buffer*/
-	if (!send_cmd(em100->dev, cmd)) {
+	if (!send_cmd(em100->dev, cmd) || send_cmd_flush()) {
 		return 0;
 	}
 	return 1;
 }
 
+/* Trace Config values, see read_report_buffer() */
+static const unsigned char trace_config[] = {
+	[TRACE_TRIGGER_SOFTWARE] = 0x15,
+	[TRACE_TRIGGER_EMULATION] = 0x10,
+	[TRACE_TRIGGER_PIN] = 0x12,
+};
+
 /**
- * read_spi_trace: fetch SPI trace data
+ * read_report_buffer: fetch SPI trace data
  * @param em100: em100 device structure
- * globals: curpos, counter, cmdid
+ * @param opts: number of reports, timeout and trigger
+ * @param reportdata: opts->reports reports of REPORT_BUFFER_LENGTH
  *
  * out(16 bytes): bc 00 00 00 08 00 00 00 00 15 00 00 00 00 00 00
  * in(8x8192 bytes): 2 bytes (BE) number of records (0..0x3ff),
  *    then records of 8 bytes each
  */
-static unsigned int counter = 0;
-static unsigned char curpos = 0;
-static unsigned char cmdid = 0xff; // timestamp, so never a valid command id
-
-#define REPORT_BUFFER_LENGTH	8192
-#define REPORT_BUFFER_COUNT	8
-
 static int read_report_buffer(struct em100 *em100,
-	unsigned char reportdata[REPORT_BUFFER_COUNT][REPORT_BUFFER_LENGTH])
+		const struct trace_options *opts, unsigned char *reportdata)
 {
 	unsigned char cmd[16] = {0};
 	int len;
@@ -65,15 +71,15 @@ static int read_report_buffer(struct em100 *em100,
 	 * cmd1..cmd4 are probably u32BE on how many
 	 * reports (8192 bytes each) to fetch
 	 */
-	cmd[1] = 0x00;
-	cmd[2] = 0x00;
-	cmd[3] = 0x00;
-	cmd[4] = REPORT_BUFFER_COUNT;
+	cmd[1] = (opts->reports >> 24) & 0xff;
+	cmd[2] = (opts->reports >> 16) & 0xff;
+	cmd[3] = (opts->reports >> 8) & 0xff;
+	cmd[4] = opts->reports & 0xff;
 	/* Timeout in ms */
-	cmd[5] = 0x00;
-	cmd[6] = 0x00;
-	cmd[7] = 0x00;
-	cmd[8] = 0x00;
+	cmd[5] = (opts->timeout >> 24) & 0xff;
+	cmd[6] = (opts->timeout >> 16) & 0xff;
+	cmd[7] = (opts->timeout >> 8) & 0xff;
+	cmd[8] = opts->timeout & 0xff;
 	/* Trace Config
 	 * [1:0] 00 start/stop spi trace according to emulation status
 	 *       01 start when TraceConfig[2] == 1
@@ -82,16 +88,23 @@ static int read_report_buffer(struct em100 *em100,
 	 * [2]   When TraceConfig[1:0] == 01 this bit starts the trace
 	 * [7:3] RFU
 	 */
-	cmd[9] = 0x15;
+	cmd[9] = trace_config[opts->trigger];
 
 	if (!send_cmd(em100->dev, cmd)) {
 		printf("sending trace command failed\n");
 		return 0;
 	}
 
-	for (report = 0; report < REPORT_BUFFER_COUNT; report++) {
-		len = get_response(em100->dev, &reportdata[report][0],
-				REPORT_BUFFER_LENGTH);
+	/*
+	 * The device may hold back each report for up to opts->timeout, so
+	 * wait longer than that or a late report would answer the next
+	 * request.
+	 */
+	for (report = 0; report < opts->reports; report++) {
+		len = get_response_timeout(em100->dev,
+				reportdata + report * REPORT_BUFFER_LENGTH,
+				REPORT_BUFFER_LENGTH,
+				opts->timeout + BULK_SEND_TIMEOUT);
 		if (len != REPORT_BUFFER_LENGTH) {
 			printf("error, report length = %d instead of %d.\n\n",
 					len, REPORT_BUFFER_LENGTH);
@@ -102,235 +115,414 @@ static int read_report_buffer(struct em100 *em100,
 	return 1;
 }
 
-struct spi_cmd_values {
-	const char *cmd_name;
-	uint8_t cmd;
-	uint8_t uses_address;
-	uint8_t pad_bytes;
+static void decode_spi_trace(struct trace_decoder *decoder,
+		unsigned char *reportdata, unsigned int reports)
+{
+	unsigned int report;
+
+	for (report = 0; report < reports; report++)
+		trace_decode_report(decoder,
+				reportdata + report * REPORT_BUFFER_LENGTH);
+	fflush(stdout);
+}
+
+#define UFIFO_SIZE	512
+#define UFIFO_TIMEOUT	0x00
+
+/*
+ * HT checkpoint messages, with the trace time they arrived at and the
+ * amount of flash data read by then, for a profile of the boot stages.
+ */
+struct checkpoint {
+	uint32_t value;
+	unsigned long long time;
+	unsigned long long read_bytes;
 };
 
-struct spi_cmd_values spi_command_list[] = {
-		/* name				cmd,	addr,	pad */
-		{"write status register",	0x01,	0,	0},
-		{"page program",		0x02,	1,	0},
-		{"read",			0x03,	1,	0},
-		{"write disable",		0x04,	0,	0},
-		{"read status register",	0x05,	0,	0},
-		{"write enable",		0x06,	0,	0},
-		{"fast read",			0x0b,	1,	1},
-		{"EM100 specific",		0x11,	0,	0},
-		{"fast dual read",		0x3b,	1,	2},
-		{"chip erase",			0x60,	0,	0},
-		{"read JEDEC ID",		0x9f,	0,	0},
-		{"chip erase",			0xc7,	0,	0},
-		{"sector erase",		0xd8,	1,	0},
-
-		{"unknown command",		0xff,	0,	0}
+struct checkpoints {
+	struct checkpoint *list;
+	size_t count, size;
 };
 
-static struct spi_cmd_values * get_command_vals(uint8_t command)
+static void add_checkpoint(struct checkpoints *cps, const struct em100_msg *msg,
+		unsigned int length, const struct trace_decoder *dec)
 {
-	/* cache last command so a search isn't needed every time */
-	static struct spi_cmd_values *spi_cmd = &spi_command_list[3]; /* init to read */
-	int i;
+	struct checkpoint *cp;
+	unsigned int k;
 
-	if (spi_cmd->cmd != command) {
-		for (i = 0; spi_command_list[i].cmd != 0xff; i++) {
-			if (spi_command_list[i].cmd == command)
-				break;
-		}
-		spi_cmd = &spi_command_list[i];
+	if (cps->count == cps->size) {
+		size_t size = cps->size ? cps->size * 2 : 64;
+
+		cp = realloc(cps->list, size * sizeof(*cp));
+		if (!cp)
+			return;
+		cps->list = cp;
+		cps->size = size;
 	}
 
-	return spi_cmd;
+	cp = &cps->list[cps->count++];
+	cp->value = 0;
+	for (k = 0; k < length && k < 4; k++)
+		cp->value |= (uint32_t)msg->data[k] << (k * 8);
+	cp->time = trace_decoder_time(dec);
+	cp->read_bytes = dec->read_bytes;
 }
 
-#define MAX_TRACE_BLOCKLENGTH	6
-int read_spi_trace(struct em100 *em100, int display_terminal,
-		unsigned long addr_offset)
+static void print_checkpoints(const struct checkpoints *cps)
 {
-	unsigned char reportdata[REPORT_BUFFER_COUNT][REPORT_BUFFER_LENGTH] =
-			{{0}};
-	unsigned char *data;
-	unsigned int count, i, report;
-	static int outbytes = 0;
-	static int additional_pad_bytes = 0;
-	static unsigned int address = 0;
-	static unsigned long long timestamp = 0;
-	static unsigned long long start_timestamp = 0;
-	static struct spi_cmd_values *spi_cmd_vals = &spi_command_list[3];
-
-	if (!read_report_buffer(em100, reportdata))
+	const struct checkpoint *prev = NULL;
+	size_t i;
+
+	if (!cps->count)
+		return;
+
+	printf("\nCheckpoint         Time (s)     Delta (ms)  Flash read (KB)\n");
+	for (i = 0; i < cps->count; i++) {
+		const struct checkpoint *cp = &cps->list[i];
+		unsigned long long delta = cp->time - (prev ? prev->time : 0);
+		unsigned long long bytes = cp->read_bytes -
+				(prev ? prev->read_bytes : 0);
+
+		printf("0x%08x  %6llu.%08llu  %13.3f  %15.1f\n", cp->value,
+			cp->time / TRACE_TICKS_PER_SECOND,
+			cp->time % TRACE_TICKS_PER_SECOND,
+			delta * 1000.0 / TRACE_TICKS_PER_SECOND,
+			bytes / 1024.0);
+		prev = cp;
+	}
+}
+
+/*
+ * HT lookup table messages carry 16 bit IDs of strings that the firmware
+ * doesn't have to send. The strings come from a text file with one
+ * "ID string" pair per line, and are kept in an array indexed by ID.
+ */
+#define LOOKUP_TABLE_SIZE	65536
+
+static const char **lookup_table;
+static char *lookup_strings;
+
+/* Expand \n, \t and \\ in place */
+static void unescape(char *str)
+{
+	char *out = str;
+
+	for (; *str; str++) {
+		if (*str == '\\' && str[1]) {
+			str++;
+			if (*str == 'n')
+				*str = '\n';
+			else if (*str == 't')
+				*str = '\t';
+		}
+		*out++ = *str;
+	}
+	*out = '\0';
+}
+
+/**
+ * load_lookup_table: load the strings for HT lookup table messages
+ * @param filename: text file with lines "ID string", # starts a comment
+ */
+int load_lookup_table(const char *filename)
+{
+	struct image file;
+	char *line, *next, *end;
+	unsigned long id;
+	unsigned int lineno = 0, count = 0;
+
+	if (!image_load(&file, filename, 64 MB))
 		return 0;
 
-	for (report = 0; report < REPORT_BUFFER_COUNT; report++) {
-		data = &reportdata[report][0];
-		count = (data[0] << 8) | data[1];
-		if (count > 1022) {
-			printf("Warning: EM100pro sends too much data.\n");
-			count = 1022;
+	lookup_strings = malloc(file.length + 1);
+	lookup_table = calloc(LOOKUP_TABLE_SIZE, sizeof(*lookup_table));
+	if (!lookup_strings || !lookup_table) {
+		printf("Out of memory.\n");
+		image_close(&file);
+		free_lookup_table();
+		return 0;
+	}
+	if (file.length)
+		memcpy(lookup_strings, file.data, file.length);
+	lookup_strings[file.length] = '\0';
+	image_close(&file);
+
+	for (line = lookup_strings; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		lineno++;
+
+		line += strspn(line, " \t\r");
+		if (!*line || *line == '#')
+			continue;
+
+		id = strtoul(line, &end, 0);
+		if (end == line || id >= LOOKUP_TABLE_SIZE ||
+				(*end && !strchr(" \t", *end))) {
+			printf("%s:%u: invalid lookup table entry\n",
+					filename, lineno);
+			free_lookup_table();
+			return 0;
 		}
-		for (i = 0; i < count; i++) {
-			unsigned int j = additional_pad_bytes;
-			additional_pad_bytes = 0;
-			unsigned char cmd = data[2 + i*8];
-			if (cmd == 0xff) {
-				/* timestamp */
-				timestamp = data[2 + i*8 + 2];
-				timestamp = (timestamp << 8) | data[2 + i*8 + 3];
-				timestamp = (timestamp << 8) | data[2 + i*8 + 4];
-				timestamp = (timestamp << 8) | data[2 + i*8 + 5];
-				timestamp = (timestamp << 8) | data[2 + i*8 + 6];
-				timestamp = (timestamp << 8) | data[2 + i*8 + 7];
-				if (display_terminal)
-					read_spi_terminal(em100, 1);
-				continue;
-			}
 
-			/* from here, it must be data */
-			if (cmd != cmdid) {
-				unsigned char spi_command = data[i * 8 + 4];
-				spi_cmd_vals = get_command_vals(spi_command);
-
-				/* new command */
-				cmdid = cmd;
-				if (counter == 0)
-					start_timestamp = timestamp;
-
-				/* set up address if used by this command*/
-				if (!spi_cmd_vals->uses_address) {
-					j = 1; /* skip command byte */
-				} else {
-					address = (data[i * 8 + 5] << 16) +
-							(data[i * 8 + 6] << 8) +
-							data[i * 8 + 7];
-
-					/* skip command, address bytes, and padding */
-					j = 4 + spi_cmd_vals->pad_bytes;
-					if (j > MAX_TRACE_BLOCKLENGTH) {
-						additional_pad_bytes = j -
-							MAX_TRACE_BLOCKLENGTH;
-						j = MAX_TRACE_BLOCKLENGTH;
-					}
-				}
-				printf("\nTime: %06lld.%08lld",
-						(timestamp - start_timestamp) /
-						100000000,
-						(timestamp - start_timestamp) %
-						100000000);
-				printf(" command # %-6d : 0x%02x - %s",
-						++counter, spi_command,
-						spi_cmd_vals->cmd_name);
-				curpos = 0;
-				outbytes = 0;
-			}
+		line = end + strspn(end, " \t");
+		line[strcspn(line, "\r")] = '\0';
+		unescape(line);
+		lookup_table[id] = line;
+		count++;
+	}
+
+	printf("Loaded %u lookup table strings from %s\n", count, filename);
+	return 1;
+}
+
+void free_lookup_table(void)
+{
+	free(lookup_table);
+	free(lookup_strings);
+	lookup_table = NULL;
+	lookup_strings = NULL;
+}
+
+static void print_lookup(unsigned int id)
+{
+	if (lookup_table && lookup_table[id])
+		printf("%s", lookup_table[id]);
+	else
+		printf("Lookup %04x", id);
+}
+
+/*
+ * HT message stream
+ *
+ * Messages don't line up with uFIFO reads: a read can hold several of
+ * them, and a message can start in one read and end in the next. So the
+ * valid bytes of every read are fed through a state machine that looks
+ * for the signature, then collects the header and the payload, and
+ * keeps partial messages until the next read. Bytes that aren't part of
+ * a message are dropped until the next signature.
+ */
+enum {
+	HT_SYNC,	/* looking for the signature */
+	HT_HEADER,
+	HT_PAYLOAD
+};
+
+struct ht_stream {
+	int state;
+	int lost;		/* dropping bytes since the last message */
+	unsigned int len;	/* bytes of msg received so far */
+	struct em100_msg msg;
+
+	unsigned int counter;	/* number of messages */
+	unsigned long long resyncs;
+	unsigned long long dropped;
+};
+
+static struct ht_stream ht_stream;
+
+/*
+ * During a trace, dec is the trace decoder, and messages are stamped with
+ * the time of its last timestamp.
+ */
+static void print_ht_message(const struct em100_msg *msg,
+		unsigned int counter, int show_counter,
+		const struct trace_decoder *dec, struct checkpoints *cps)
+{
+	unsigned int k;
+
+	if (show_counter && dec) {
+		unsigned long long time = trace_decoder_time(dec);
+
+		printf("\nHT%06d @ %06lld.%08lld: ", counter,
+			time / TRACE_TICKS_PER_SECOND,
+			time % TRACE_TICKS_PER_SECOND);
+	} else if (show_counter) {
+		printf("\nHT%06d: ", counter);
+	}
+
+	/* print message byte according to format */
+	for (k = 0; k < msg->header.data_length; k++) {
+		switch (msg->header.data_type) {
+		case ht_checkpoint_1byte:
+		case ht_checkpoint_2bytes:
+		case ht_checkpoint_4bytes:
+		case ht_hexadecimal_data:
+		case ht_timestamp_data:
+			printf("%02x ", msg->data[k]);
+			break;
+		case ht_ascii_data:
+			printf("%c", msg->data[k]);
+			break;
+		case ht_lookup_table:
+			if (k + 1 >= msg->header.data_length)
+				break;
+			print_lookup((msg->data[k] << 8) | msg->data[k + 1]);
+			k++;
+			break;
+		}
+	}
+
+	if (cps && dec && msg->header.data_type >= ht_checkpoint_1byte &&
+			msg->header.data_type <= ht_checkpoint_4bytes)
+		add_checkpoint(cps, msg, k, dec);
+
+	fflush(stdout);
+}
+
+/* Give up on the bytes collected so far */
+static void ht_resync(struct ht_stream *st, unsigned int drop)
+{
+	st->dropped += drop;
+	if (drop && !st->lost) {
+		st->lost = 1;
+		st->resyncs++;
+	}
+}
+
+static void parse_spi_terminal(unsigned char *data, int show_counter,
+		const struct trace_decoder *dec, struct checkpoints *cps)
+{
+	struct ht_stream *st = &ht_stream;
+	unsigned char *buf = (unsigned char *)&st->msg;
+	uint16_t data_length;
+	unsigned int j;
+
+	/* the first two bytes are the amount of valid data */
+	data_length = (data[0] << 8) + data[1];
+	if (data_length > UFIFO_SIZE - sizeof(uint16_t))
+		data_length = UFIFO_SIZE - sizeof(uint16_t);
 
-			/* this exploits 8bit wrap around in curpos */
-			unsigned char blocklen = (data[2 + i*8 + 1] - curpos);
-			blocklen /= 8;
-
-			for (; j < blocklen; j++) {
-				if (outbytes == 0) {
-					if (spi_cmd_vals->uses_address) {
-						printf("\n%08lx : ",
-								addr_offset +
-								address);
-					} else {
-						printf("\n         : ");
-					}
-				}
-				printf("%02x ", data[i * 8 + 4 + j]);
-				outbytes++;
-				if (outbytes == 16) {
-					outbytes = 0;
-					if (spi_cmd_vals->uses_address)
-						address += 16;
-				}
+	/* actual data starts after the length */
+	for (j = 0; j < data_length; j++) {
+		unsigned char byte = data[sizeof(uint16_t) + j];
+
+		switch (st->state) {
+		case HT_SYNC:
+			/* the signature is little endian */
+			if (byte == ((EM100_MSG_SIGNATURE >> (8 * st->len)) &
+					0xff)) {
+				buf[st->len++] = byte;
+				if (st->len == sizeof(st->msg.header.signature))
+					st->state = HT_HEADER;
+			} else if (byte == (EM100_MSG_SIGNATURE & 0xff)) {
+				ht_resync(st, st->len);
+				buf[0] = byte;
+				st->len = 1;
+			} else {
+				ht_resync(st, st->len + 1);
+				st->len = 0;
+			}
+			continue;
+		case HT_HEADER:
+			buf[st->len++] = byte;
+			if (st->len < sizeof(struct em100_msg_header))
+				continue;
+			if (st->msg.header.data_type < ht_checkpoint_1byte ||
+					st->msg.header.data_type >
+					ht_lookup_table) {
+				/* not a message after all */
+				ht_resync(st, st->len);
+				st->len = 0;
+				st->state = HT_SYNC;
+				continue;
 			}
-			// this is because the em100 counts funny
-			curpos = data[2 + i*8 + 1] + 0x10;
-			fflush(stdout);
+			st->state = HT_PAYLOAD;
+			break;
+		case HT_PAYLOAD:
+			buf[st->len++] = byte;
+			break;
 		}
+
+		if (st->len < sizeof(struct em100_msg_header) +
+				st->msg.header.data_length)
+			continue;
+
+		/* complete */
+		print_ht_message(&st->msg, ++st->counter, show_counter, dec,
+				cps);
+		st->len = 0;
+		st->lost = 0;
+		st->state = HT_SYNC;
 	}
-	return 1;
 }
 
-#define UFIFO_SIZE	512
-#define UFIFO_TIMEOUT	0x00
+static void print_ht_stream_stats(void)
+{
+	printf("HT: %u messages, %llu resyncs, %llu bytes dropped.\n",
+		ht_stream.counter, ht_stream.resyncs, ht_stream.dropped);
+}
 
 /*
  * Polls the uFIFO buffer to see if there's any data. The HT registers don't
  * seem to ever be updated to reflect that there's data present, and the
  * Dediprog software doesn't use them either.
  *
- * Multiple messages can be in a single uFIFO transfer, so loop through
- * the data looking for the signature.
+ * Returns the number of bytes in the uFIFO, or -1 on error.
  */
-int read_spi_terminal(struct em100 *em100, int show_counter)
+static int poll_spi_terminal(struct em100 *em100, int show_counter)
 {
 	unsigned char data[UFIFO_SIZE] = { 0 };
-	static unsigned int msg_counter = 1; /* Number of messages */
-	uint16_t data_length;
-	unsigned char *data_start;
-	unsigned int j, k;
-	struct em100_msg *msg = NULL;
 
 	if (!read_ufifo(em100, UFIFO_SIZE, UFIFO_TIMEOUT, &data[0]))
-		return 0;
+		return -1;
 
-	/* the first two bytes are the amount of valid data */
-	data_length = (data[0] << 8) + data[1];
-	if (data_length == 0)
-		return 1;
+	parse_spi_terminal(data, show_counter, NULL, NULL);
+	return (data[0] << 8) | data[1];
+}
 
-	/* actual data starts after the length */
-	data_start = &data[sizeof(uint16_t)];
-
-	/* examine data; stop when we run out of message or buffer */
-	for (j = 0; j < data_length &&
-			j < UFIFO_SIZE - sizeof(struct em100_msg_header); j++) {
-
-		msg = (struct em100_msg *)(data_start + j);
-		if (msg->header.signature == EM100_MSG_SIGNATURE) {
-
-			if (show_counter)
-				printf("\nHT%06d: ", msg_counter);
-
-			/* print message byte according to format */
-			for (k = 0; k < msg->header.data_length; k++) {
-				if (&msg->data[k] >= data_start + data_length)
-					break;
-				if (&msg->data[k] >= &data[0] + UFIFO_SIZE)
-					break;
-
-				switch (msg->header.data_type) {
-				case ht_checkpoint_1byte:
-				case ht_checkpoint_2bytes:
-				case ht_checkpoint_4bytes:
-				case ht_hexadecimal_data:
-				case ht_timestamp_data:
-					printf("%02x ", msg->data[k]);
-					break;
-				case ht_ascii_data:
-					printf("%c", msg->data[k]);
-					break;
-				case ht_lookup_table:
-					/* TODO - support lookup table */
-					printf("Lookup unsupported: %02x%02x",
-						msg->data[k], msg->data[k + 1]);
-					k++;
-					break;
-				}
-			}
+/*
+ * Every poll costs a USB round trip, so while the uFIFO stays empty the
+ * time between polls doubles up to TERMINAL_POLL_MAX. As soon as there
+ * is data, we poll again right away until it stops flowing.
+ */
+#define TERMINAL_POLL_MIN	250000		/* ns */
+#define TERMINAL_POLL_MAX	64000000	/* ns */
 
-			/* advance to the end of the message */
-			j += msg->header.data_length +
-					sizeof(struct em100_msg_header) - 1;
-			msg_counter++;
-			fflush(stdout);
+/**
+ * run_spi_terminal: show HT messages until asked to stop
+ * @param em100: em100 device structure
+ * @param exit_flag: set asynchronously to end the terminal
+ */
+int run_spi_terminal(struct em100 *em100, volatile int *exit_flag)
+{
+	unsigned long long polls = 0, data_polls = 0, errors = 0, bytes = 0;
+	unsigned long long slept = 0;
+	struct timespec wait = { 0, 0 };
+	uint64_t start = capture_clock();
+	double secs;
+	int len;
+
+	while (!*exit_flag) {
+		len = poll_spi_terminal(em100, 0);
+		polls++;
+
+		if (len > 0) {
+			data_polls++;
+			bytes += len;
+			wait.tv_nsec = 0;
+			continue;
 		}
+		if (len < 0)
+			errors++;
+
+		wait.tv_nsec = wait.tv_nsec ? wait.tv_nsec * 2 :
+				TERMINAL_POLL_MIN;
+		if (wait.tv_nsec > TERMINAL_POLL_MAX)
+			wait.tv_nsec = TERMINAL_POLL_MAX;
+		nanosleep(&wait, NULL);
+		slept += wait.tv_nsec;
 	}
 
+	secs = (capture_clock() - start) / 1e9;
+
+	printf("\nTerminal: %llu polls in %.1f s (%.1f/s), %llu with data "
+		"(%.1f%%), %llu bytes, %llu errors, idle %.1f%% of the time.\n",
+		polls, secs, secs > 0 ? polls / secs : 0.0, data_polls,
+		polls ? 100.0 * data_polls / polls : 0.0, bytes, errors,
+		secs > 0 ? slept / 1e7 / secs : 0.0);
+	print_ht_stream_stats();
 	return 1;
 }
 
@@ -348,3 +540,221 @@ int init_spi_terminal (struct em100 *em100)
 
 	return retval;
 }
+
+/*
+ * Trace acquisition pipeline
+ *
+ * Decoding and printing a trace is a lot slower than fetching it, and
+ * the EM100Pro only buffers a limited amount of SPI activity. So one
+ * thread does nothing but read report buffers (and the uFIFO) back to
+ * back and puts them on a single producer, single consumer ring, while
+ * the main thread decodes or captures them.
+ *
+ * The ring never blocks the producer. If it is full, the reports are
+ * read into a scratch buffer and counted as dropped, so the device
+ * buffer keeps draining.
+ */
+#define TRACE_RING_SLOTS	64	/* must be a power of two */
+#define TRACE_IDLE_WAIT		1000000	/* ns */
+
+enum {
+	TRACE_SLOT_REPORTS,
+	TRACE_SLOT_UFIFO
+};
+
+struct trace_slot {
+	int type;
+	uint64_t time;
+	unsigned char *data;
+};
+
+struct trace_ring {
+	struct trace_slot slot[TRACE_RING_SLOTS];
+	atomic_uint head;	/* only written by the producer */
+	atomic_uint tail;	/* only written by the consumer */
+	atomic_int stop;
+	atomic_int done;
+
+	struct em100 *em100;
+	struct trace_options opts;
+	unsigned char *scratch;
+
+	/* statistics, only written by the producer */
+	unsigned long long buffers;
+	unsigned long long dropped;
+	unsigned int high_water;
+};
+
+static int has_records(unsigned char *data, int type, unsigned int reports)
+{
+	unsigned int report;
+
+	if (type == TRACE_SLOT_UFIFO)
+		return data[0] || data[1];
+
+	for (report = 0; report < reports; report++)
+		if (data[report * REPORT_BUFFER_LENGTH] ||
+				data[report * REPORT_BUFFER_LENGTH + 1])
+			return 1;
+	return 0;
+}
+
+static void trace_produce(struct trace_ring *ring, int type)
+{
+	unsigned int head = atomic_load_explicit(&ring->head,
+			memory_order_relaxed);
+	unsigned int used = head - atomic_load_explicit(&ring->tail,
+			memory_order_acquire);
+	struct trace_slot *slot = &ring->slot[head % TRACE_RING_SLOTS];
+	unsigned char *data = used < TRACE_RING_SLOTS ?
+			slot->data : ring->scratch;
+	int ok;
+
+	if (type == TRACE_SLOT_REPORTS)
+		ok = read_report_buffer(ring->em100, &ring->opts, data);
+	else
+		ok = read_ufifo(ring->em100, UFIFO_SIZE, UFIFO_TIMEOUT, data);
+
+	/* Don't clutter the ring with empty reads */
+	if (!ok || !has_records(data, type, ring->opts.reports))
+		return;
+
+	ring->buffers++;
+	if (data == ring->scratch) {
+		ring->dropped++;
+		return;
+	}
+
+	slot->type = type;
+	slot->time = capture_clock();
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	if (++used > ring->high_water)
+		ring->high_water = used;
+}
+
+static void *trace_producer(void *arg)
+{
+	struct trace_ring *ring = arg;
+
+	while (!atomic_load(&ring->stop)) {
+		trace_produce(ring, TRACE_SLOT_REPORTS);
+		if (ring->opts.terminal)
+			trace_produce(ring, TRACE_SLOT_UFIFO);
+	}
+
+	atomic_store(&ring->done, 1);
+	return NULL;
+}
+
+/**
+ * run_spi_trace: trace until asked to stop
+ * @param em100: em100 device structure
+ * @param opts: what to do with the trace
+ * @param exit_flag: set asynchronously to end the trace
+ *
+ * While the trace runs, the device must not be used by anyone else.
+ */
+int run_spi_trace(struct em100 *em100, const struct trace_options *opts,
+		volatile int *exit_flag)
+{
+	const struct timespec idle = { 0, TRACE_IDLE_WAIT };
+	struct trace_decoder decoder;
+	struct checkpoints checkpoints = { NULL, 0, 0 };
+	struct trace_ring *ring;
+	unsigned char *buffers;
+	size_t slot_length;
+	sigset_t mask, oldmask;
+	pthread_t thread;
+	unsigned int i, reports;
+	int ret;
+
+	reports = opts->reports ? opts->reports : REPORT_BUFFER_COUNT;
+	if (reports > REPORT_BUFFER_MAX_COUNT)
+		reports = REPORT_BUFFER_MAX_COUNT;
+
+	slot_length = reports * REPORT_BUFFER_LENGTH;
+
+	ring = calloc(1, sizeof(*ring));
+	buffers = malloc((TRACE_RING_SLOTS + 1) * slot_length);
+	if (!ring || !buffers) {
+		printf("Out of memory.\n");
+		free(buffers);
+		free(ring);
+		return 0;
+	}
+
+	for (i = 0; i < TRACE_RING_SLOTS; i++)
+		ring->slot[i].data = buffers + i * slot_length;
+	ring->scratch = buffers + TRACE_RING_SLOTS * slot_length;
+	ring->em100 = em100;
+	ring->opts = *opts;
+	ring->opts.reports = reports;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->stop, 0);
+	atomic_init(&ring->done, 0);
+	trace_decoder_init(&decoder, opts->addr_offset);
+	decoder.quiet = opts->capture || opts->stats;
+	decoder.stats = opts->stats;
+	decoder.filter = opts->filter;
+
+	/* Let the main thread handle CTRL-C, not the USB thread */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	ret = pthread_create(&thread, NULL, trace_producer, ring);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	if (ret) {
+		printf("Could not start trace thread: %s\n", strerror(ret));
+		free(buffers);
+		free(ring);
+		return 0;
+	}
+
+	for (;;) {
+		unsigned int tail = atomic_load_explicit(&ring->tail,
+				memory_order_relaxed);
+		struct trace_slot *slot = &ring->slot[tail % TRACE_RING_SLOTS];
+
+		if (*exit_flag)
+			atomic_store(&ring->stop, 1);
+
+		if (tail == atomic_load_explicit(&ring->head,
+				memory_order_acquire)) {
+			if (atomic_load(&ring->done))
+				break;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		if (slot->type == TRACE_SLOT_UFIFO) {
+			parse_spi_terminal(slot->data, 1, &decoder,
+					&checkpoints);
+		} else {
+			if (opts->capture)
+				capture_write_reports(opts->capture,
+						slot->time, slot->data, reports);
+			/* HT messages need the time, even when capturing */
+			if (!opts->capture || opts->stats || opts->terminal)
+				decode_spi_trace(&decoder, slot->data, reports);
+		}
+
+		atomic_store_explicit(&ring->tail, tail + 1,
+				memory_order_release);
+	}
+
+	pthread_join(thread, NULL);
+
+	printf("\nTrace: %llu buffers, ring high-water mark %u of %u, "
+			"%llu dropped.\n", ring->buffers, ring->high_water,
+			TRACE_RING_SLOTS, ring->dropped);
+	if (opts->terminal)
+		print_ht_stream_stats();
+	print_checkpoints(&checkpoints);
+
+	free(checkpoints.list);
+
+	free(buffers);
+	free(ring);
+	return 1;
+}
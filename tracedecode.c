@@ -0,0 +1,438 @@
+/*
+ * Copyright 2012-2015 Google Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "em100.h"
+
+/* SPI trace decoder, shared by em100 and em100-tracedump */
+
+/*
+ * SPI opcodes
+ *
+ * The EM100Pro records the bytes of a command as they are seen on the
+ * bus, dummy cycles included. Those take dummy_cycles * data lanes / 8
+ * bytes in the trace, e.g. one byte for a fast read (0x0b) and two for a
+ * fast dual read (0x3b).
+ *
+ * Opcodes with a 3 byte address take a 4 byte address while the chip is
+ * in 4-byte address mode, unless they are marked OP_FIXED_ADDR. In 3-byte
+ * address mode, the extended address register provides A31..A24.
+ * OP_OTHER_SPACE marks addresses that aren't in the flash array, like
+ * those of security registers and SFDP.
+ */
+struct spi_opcode {
+	const char *name;
+	uint8_t addr_bytes;
+	uint8_t dummy_cycles;
+	uint8_t lanes;		/* data lanes */
+	uint8_t class;
+	uint8_t flags;
+};
+
+#define OP_FIXED_ADDR	(1 << 0)
+#define OP_OTHER_SPACE	(1 << 1)
+
+#define OPF(name, addr, dummy, lanes, class, flags) \
+	{ name, addr, dummy, lanes, SPI_CLASS_##class, flags }
+#define OP(name, addr, dummy, lanes, class) \
+	OPF(name, addr, dummy, lanes, class, 0)
+
+static const struct spi_opcode spi_opcodes[256] = {
+	/*		name				addr	dummy	lanes	class */
+	[0x01] = OP("write status register",	0,	0,	1,	STATUS),
+	[0x02] = OP("page program",		3,	0,	1,	PROGRAM),
+	[0x03] = OP("read",			3,	0,	1,	READ),
+	[0x04] = OP("write disable",		0,	0,	1,	OTHER),
+	[0x05] = OP("read status register",	0,	0,	1,	STATUS),
+	[0x06] = OP("write enable",		0,	0,	1,	OTHER),
+	[0x0b] = OP("fast read",		3,	8,	1,	FAST_READ),
+	[0x0c] = OP("fast read 4B",		4,	8,	1,	FAST_READ),
+	[0x11] = OP("EM100 specific",		0,	0,	1,	OTHER),
+	[0x12] = OP("page program 4B",		4,	0,	1,	PROGRAM),
+	[0x13] = OP("read 4B",			4,	0,	1,	READ),
+	[0x15] = OP("read status register 3",	0,	0,	1,	STATUS),
+	[0x16] = OP("read bank register",	0,	0,	1,	OTHER),
+	[0x17] = OP("write bank register",	0,	0,	1,	OTHER),
+	[0x20] = OP("sector erase 4K",		3,	0,	1,	ERASE),
+	[0x21] = OP("sector erase 4K 4B",	4,	0,	1,	ERASE),
+	[0x31] = OP("write status register 2",	0,	0,	1,	STATUS),
+	[0x32] = OP("quad page program",	3,	0,	4,	PROGRAM),
+	[0x34] = OP("quad page program 4B",	4,	0,	4,	PROGRAM),
+	[0x35] = OP("read status register 2",	0,	0,	1,	STATUS),
+	[0x38] = OP("quad I/O page program",	3,	0,	4,	PROGRAM),
+	[0x3b] = OP("fast dual read",		3,	8,	2,	DUAL_READ),
+	[0x3c] = OP("fast dual read 4B",	4,	8,	2,	DUAL_READ),
+	[0x3e] = OP("quad I/O page program 4B",	4,	0,	4,	PROGRAM),
+	[0x42] = OPF("program security register",3,	0,	1,	PROGRAM,
+			OP_OTHER_SPACE),
+	[0x44] = OPF("erase security register",	3,	0,	1,	ERASE,
+			OP_OTHER_SPACE),
+	[0x48] = OPF("read security register",	3,	8,	1,	READ,
+			OP_OTHER_SPACE),
+	[0x4b] = OP("read unique ID",		0,	0,	1,	ID),
+	[0x50] = OP("write enable volatile SR",	0,	0,	1,	OTHER),
+	[0x52] = OP("block erase 32K",		3,	0,	1,	ERASE),
+	[0x5a] = OPF("read SFDP",		3,	8,	1,	ID,
+			OP_FIXED_ADDR | OP_OTHER_SPACE),
+	[0x5c] = OP("block erase 32K 4B",	4,	0,	1,	ERASE),
+	[0x60] = OP("chip erase",		0,	0,	1,	ERASE),
+	[0x66] = OP("enable reset",		0,	0,	1,	OTHER),
+	[0x6b] = OP("fast quad read",		3,	8,	4,	QUAD_READ),
+	[0x6c] = OP("fast quad read 4B",	4,	8,	4,	QUAD_READ),
+	[0x75] = OP("suspend",			0,	0,	1,	OTHER),
+	[0x7a] = OP("resume",			0,	0,	1,	OTHER),
+	[0x90] = OPF("read manufacturer ID",	3,	0,	1,	ID,
+			OP_FIXED_ADDR),
+	[0x99] = OP("reset",			0,	0,	1,	OTHER),
+	[0x9f] = OP("read JEDEC ID",		0,	0,	1,	ID),
+	[0xab] = OP("release power-down",	0,	0,	1,	OTHER),
+	[0xb7] = OP("enter 4-byte address mode",0,	0,	1,	OTHER),
+	[0xb9] = OP("power-down",		0,	0,	1,	OTHER),
+	[0xbb] = OP("fast dual I/O read",	3,	4,	2,	DUAL_READ),
+	[0xbc] = OP("fast dual I/O read 4B",	4,	4,	2,	DUAL_READ),
+	[0xc5] = OP("write extended address",	0,	0,	1,	OTHER),
+	[0xc7] = OP("chip erase",		0,	0,	1,	ERASE),
+	[0xc8] = OP("read extended address",	0,	0,	1,	OTHER),
+	[0xd8] = OP("sector erase",		3,	0,	1,	ERASE),
+	[0xdc] = OP("sector erase 4B",		4,	0,	1,	ERASE),
+	[0xe7] = OP("quad I/O word read",	3,	4,	4,	QUAD_READ),
+	[0xe9] = OP("exit 4-byte address mode",	0,	0,	1,	OTHER),
+	[0xeb] = OP("fast quad I/O read",	3,	6,	4,	QUAD_READ),
+	[0xec] = OP("fast quad I/O read 4B",	4,	6,	4,	QUAD_READ),
+};
+
+static const struct spi_opcode unknown_opcode =
+	OP("unknown command",			0,	0,	1,	OTHER);
+
+static const struct spi_opcode *get_opcode(uint8_t opcode)
+{
+	if (!spi_opcodes[opcode].name)
+		return &unknown_opcode;
+	return &spi_opcodes[opcode];
+}
+
+/**
+ * trace_command_name: name of an SPI command
+ * @param opcode: SPI command byte
+ */
+const char *trace_command_name(uint8_t opcode)
+{
+	return get_opcode(opcode)->name;
+}
+
+/**
+ * trace_command_class: SPI_CLASS_* of an SPI command
+ * @param opcode: SPI command byte
+ */
+int trace_command_class(uint8_t opcode)
+{
+	return get_opcode(opcode)->class;
+}
+
+/**
+ * trace_decoder_init: reset decoder state
+ * @param dec: decoder
+ * @param addr_offset: added to printed addresses
+ *
+ * Everything is printed until the window is narrowed by the caller.
+ */
+void trace_decoder_init(struct trace_decoder *dec, unsigned long addr_offset)
+{
+	memset(dec, 0, sizeof(*dec));
+	dec->addr_offset = addr_offset;
+	dec->last_command = ~0ULL;
+	dec->end_time = ~0ULL;
+	dec->state.cmdid = 0xff; /* timestamp, so never a valid command id */
+	dec->state.opcode = 0x03;
+}
+
+/**
+ * trace_decoder_time: time of the last timestamp record
+ * @param dec: decoder
+ *
+ * In TRACE_TICKS_PER_SECOND units, relative to the first command.
+ */
+unsigned long long trace_decoder_time(const struct trace_decoder *dec)
+{
+	if (!dec->state.counter)
+		return 0;
+	return dec->state.timestamp - dec->state.start_timestamp;
+}
+
+/* Whether the data of a command is read from the flash array */
+static int reads_array(const struct spi_opcode *op)
+{
+	return op->class >= SPI_CLASS_READ && op->class <= SPI_CLASS_QUAD_READ &&
+		!(op->flags & OP_OTHER_SPACE);
+}
+
+static int in_window(const struct trace_decoder *dec)
+{
+	unsigned long long time = trace_decoder_time(dec);
+
+	return dec->state.counter >= dec->first_command &&
+		dec->state.counter <= dec->last_command &&
+		time >= dec->start_time && time <= dec->end_time;
+}
+
+#define MAX_TRACE_BLOCKLENGTH	6
+
+/* The next record that isn't just more data of the current command */
+static unsigned int next_boundary(const struct trace_scan *scan,
+		unsigned int i, unsigned int count)
+{
+	unsigned int word = i / 64;
+	uint64_t bits = (scan->timestamp[word] | scan->boundary[word]) &
+			(~0ULL << (i % 64));
+
+	while (!bits) {
+		if (++word == TRACE_SCAN_WORDS)
+			return count;
+		bits = scan->timestamp[word] | scan->boundary[word];
+	}
+
+	i = word * 64 + __builtin_ctzll(bits);
+	return i < count ? i : count;
+}
+
+/*
+ * Account data records [i, end) of the current command without looking
+ * at the data, for when nothing is printed.
+ */
+static void skip_data(struct trace_decoder *dec, const struct spi_opcode *op,
+		const unsigned char *data, unsigned int i, unsigned int end)
+{
+	struct trace_decoder_state *s = &dec->state;
+	unsigned int bytes = 0, total;
+
+	for (; i < end; i++) {
+		/* this exploits 8bit wrap around in curpos */
+		unsigned char blocklen = (data[2 + i*8 + 1] - s->curpos);
+		blocklen /= 8;
+
+		if (s->additional_pad_bytes < blocklen)
+			bytes += blocklen - s->additional_pad_bytes;
+		s->additional_pad_bytes = 0;
+		s->curpos = data[2 + i*8 + 1] + 0x10;
+	}
+
+	if (!bytes)
+		return;
+
+	if (!dec->muted && reads_array(op))
+		dec->read_bytes += bytes;
+	if (!dec->muted && dec->stats)
+		trace_stats_data(dec->stats, s->address + s->outbytes, bytes);
+
+	total = s->outbytes + bytes;
+	if (op->addr_bytes)
+		s->address += total & ~15;
+	s->outbytes = total & 15;
+}
+
+/**
+ * trace_decode_report: print the records of one SPI trace report
+ * @param dec: decoder
+ * @param data: 2 bytes (BE) number of records, then records of 8 bytes
+ *
+ * Commands can span reports, so state is kept in the decoder.
+ */
+void trace_decode_report(struct trace_decoder *dec, const unsigned char *data)
+{
+	struct trace_decoder_state *s = &dec->state;
+	const struct spi_opcode *op = get_opcode(s->opcode);
+	struct trace_scan scan;
+	unsigned int count, i;
+
+	count = (data[0] << 8) | data[1];
+	if (count > REPORT_MAX_RECORDS) {
+		printf("Warning: EM100pro sends too much data.\n");
+		count = REPORT_MAX_RECORDS;
+	}
+
+	if (!dec->scalar)
+		trace_scan_report(data + 2, count, s->cmdid, &scan);
+
+	for (i = 0; i < count; i++) {
+		/*
+		 * Skip straight to the next timestamp or command, unless
+		 * the data is printed or reconstructed. Extended address
+		 * register writes always look at their data.
+		 */
+		if (!dec->scalar && (dec->muted || (dec->quiet &&
+				!(dec->image && reads_array(op)))) &&
+				s->opcode != 0xc5 && s->opcode != 0x17) {
+			unsigned int end = next_boundary(&scan, i, count);
+
+			if (end > i) {
+				skip_data(dec, op, data, i, end);
+				i = end;
+				if (i == count)
+					break;
+			}
+		}
+
+		unsigned int j = s->additional_pad_bytes;
+		s->additional_pad_bytes = 0;
+		unsigned char cmd = data[2 + i*8];
+		if (cmd == 0xff) {
+			/* timestamp */
+			s->timestamp = data[2 + i*8 + 2];
+			s->timestamp = (s->timestamp << 8) | data[2 + i*8 + 3];
+			s->timestamp = (s->timestamp << 8) | data[2 + i*8 + 4];
+			s->timestamp = (s->timestamp << 8) | data[2 + i*8 + 5];
+			s->timestamp = (s->timestamp << 8) | data[2 + i*8 + 6];
+			s->timestamp = (s->timestamp << 8) | data[2 + i*8 + 7];
+			continue;
+		}
+
+		/* from here, it must be data */
+		if (cmd != s->cmdid) {
+			unsigned char spi_command = data[i * 8 + 4];
+			unsigned int k;
+
+			op = get_opcode(spi_command);
+
+			/* new command */
+			s->cmdid = cmd;
+			s->opcode = spi_command;
+			if (s->counter == 0)
+				s->start_timestamp = s->timestamp;
+			s->counter++;
+
+			/* commands that change the addressing */
+			switch (spi_command) {
+			case 0xb7:
+				s->addr4 = 1;
+				break;
+			case 0xe9:
+				s->addr4 = 0;
+				break;
+			case 0x99:
+				s->addr4 = 0;
+				s->ext_addr = 0;
+				break;
+			}
+
+			/* set up address if used by this command*/
+			if (!op->addr_bytes) {
+				j = 1; /* skip command byte */
+			} else {
+				unsigned int addr_bytes = op->addr_bytes;
+
+				if (addr_bytes == 3 && s->addr4 &&
+						!(op->flags & OP_FIXED_ADDR))
+					addr_bytes = 4;
+
+				s->address = 0;
+				for (k = 1; k <= addr_bytes; k++)
+					s->address = (s->address << 8) |
+							data[i * 8 + 4 + k];
+				if (addr_bytes == 3 &&
+						!(op->flags & OP_FIXED_ADDR))
+					s->address |= (unsigned int)s->ext_addr << 24;
+
+				/* skip command, address bytes, and padding */
+				j = 1 + addr_bytes +
+					op->dummy_cycles * op->lanes / 8;
+				if (j > MAX_TRACE_BLOCKLENGTH) {
+					s->additional_pad_bytes = j -
+						MAX_TRACE_BLOCKLENGTH;
+					j = MAX_TRACE_BLOCKLENGTH;
+				}
+			}
+			dec->muted = !in_window(dec) || (dec->filter &&
+				!trace_filter_match(dec->filter, spi_command,
+					op->addr_bytes != 0,
+					dec->addr_offset + s->address,
+					trace_decoder_time(dec)));
+
+			if (!dec->muted && dec->stats)
+				trace_stats_command(dec->stats, spi_command,
+					op->addr_bytes != 0, s->address,
+					trace_decoder_time(dec));
+			if (!dec->muted && !dec->quiet) {
+				unsigned long long time =
+						trace_decoder_time(dec);
+
+				printf("\nTime: %06lld.%08lld",
+					time / TRACE_TICKS_PER_SECOND,
+					time % TRACE_TICKS_PER_SECOND);
+				printf(" command # %-6llu : 0x%02x - %s",
+						s->counter, spi_command,
+						op->name);
+			}
+			s->curpos = 0;
+			s->outbytes = 0;
+		}
+
+		/* this exploits 8bit wrap around in curpos */
+		unsigned char blocklen = (data[2 + i*8 + 1] - s->curpos);
+		blocklen /= 8;
+
+		/* first data byte of an extended address register write */
+		if (j < blocklen && s->outbytes == 0) {
+			unsigned char val = data[i * 8 + 4 + j];
+
+			if (s->opcode == 0xc5) {
+				s->ext_addr = val;
+			} else if (s->opcode == 0x17) {
+				/* Spansion bank register: EXTADD, BA30..BA24 */
+				s->addr4 = val >> 7;
+				s->ext_addr = val & 0x7f;
+			}
+		}
+
+		if (j < blocklen && !dec->muted && dec->stats)
+			trace_stats_data(dec->stats, s->address + s->outbytes,
+					blocklen - j);
+
+		if (j < blocklen && !dec->muted && reads_array(op))
+			dec->read_bytes += blocklen - j;
+
+		if (j < blocklen && !dec->muted && dec->image &&
+				reads_array(op))
+			trace_image_data(dec->image, s->address + s->outbytes,
+					&data[i * 8 + 4 + j], blocklen - j);
+
+		if (j < blocklen && (dec->muted || dec->quiet)) {
+			/* keep the address in sync */
+			s->outbytes += blocklen - j;
+			if (op->addr_bytes)
+				s->address += s->outbytes & ~15;
+			s->outbytes &= 15;
+			j = blocklen;
+		}
+
+		for (; j < blocklen; j++) {
+			if (s->outbytes == 0) {
+				if (op->addr_bytes) {
+					printf("\n%08lx : ",
+						dec->addr_offset + s->address);
+				} else {
+					printf("\n         : ");
+				}
+			}
+			printf("%02x ", data[i * 8 + 4 + j]);
+			s->outbytes++;
+			if (s->outbytes == 16) {
+				s->outbytes = 0;
+				if (op->addr_bytes)
+					s->address += 16;
+			}
+		}
+		// this is because the em100 counts funny
+		s->curpos = data[2 + i*8 + 1] + 0x10;
+	}
+}
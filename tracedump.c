@@ -0,0 +1,704 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "em100.h"
+
+/* Trace Capture Index File Format
+ * ===============================
+ *
+ * Decoding has to start at the beginning of a capture, because commands
+ * span reports. To avoid that, em100-tracedump keeps a snapshot of the
+ * decoder state every INDEX_INTERVAL trace blocks in CAPTURE.idx, and
+ * starts decoding at the last snapshot before the requested window.
+ * All values are little endian.
+ *
+ * Index header:
+ *  0x0000000: 45 4d 31 30 30 49 44 58     - magic "EM100IDX" (8 bytes)
+ *  0x0000008: 02 00                       - version          (2 bytes)
+ *  0x000000a: 30 00                       - entry size       (2 bytes)
+ *  0x000000c: 40 00 00 00                 - blocks per entry (4 bytes)
+ *  0x0000010: capture file size                              (8 bytes)
+ *  0x0000018: capture file mtime                             (8 bytes)
+ *  0x0000020: number of entries                              (8 bytes)
+ *  0x0000028: number of commands in capture                  (8 bytes)
+ *  0x0000030: duration of capture in ticks                   (8 bytes)
+ *  0x0000038: reserved                                       (8 bytes)
+ *
+ * Entries, one per INDEX_INTERVAL trace blocks:
+ *  0x00: file offset of the block                            (8 bytes)
+ *  0x08: command counter                                     (8 bytes)
+ *  0x10: timestamp                                           (8 bytes)
+ *  0x18: timestamp of first command                          (8 bytes)
+ *  0x20: address                                             (4 bytes)
+ *  0x24: curpos, cmdid, opcode, outbytes, pad bytes          (5 bytes)
+ *  0x29: 4-byte address mode, extended address register      (2 bytes)
+ *  0x2b: reserved                                            (5 bytes)
+ *
+ * The index is rebuilt whenever the capture's size or mtime changed.
+ */
+
+#define INDEX_MAGIC		"EM100IDX"
+#define INDEX_VERSION		2
+#define INDEX_HEADER_SIZE	0x40
+#define INDEX_ENTRY_SIZE	0x30
+#define INDEX_INTERVAL		64
+
+struct index_entry {
+	uint64_t offset;
+	struct trace_decoder_state state;
+};
+
+struct trace_index {
+	uint64_t size, mtime;
+	uint64_t commands, duration;
+	uint64_t count;
+	struct index_entry *entries;
+};
+
+static uint32_t get_le32(const unsigned char *in)
+{
+	return ((uint32_t)in[3] << 24) | (in[2] << 16) | (in[1] << 8) | in[0];
+}
+
+static uint64_t get_le64(const unsigned char *in)
+{
+	return (uint64_t)get_le32(in + 4) << 32 | get_le32(in);
+}
+
+static void put_le32(unsigned char *out, uint32_t val)
+{
+	out[0] = val&0xff;
+	out[1] = (val>>8)&0xff;
+	out[2] = (val>>16)&0xff;
+	out[3] = (val>>24)&0xff;
+}
+
+static void put_le64(unsigned char *out, uint64_t val)
+{
+	put_le32(out, val & 0xffffffff);
+	put_le32(out + 4, val >> 32);
+}
+
+static uint64_t entry_time(const struct trace_decoder_state *state)
+{
+	if (!state->counter)
+		return 0;
+	return state->timestamp - state->start_timestamp;
+}
+
+static int add_entry(struct trace_index *index, uint64_t offset,
+		const struct trace_decoder_state *state)
+{
+	struct index_entry *entries;
+
+	/* grow in powers of two */
+	if (!(index->count & (index->count - 1))) {
+		entries = realloc(index->entries, (index->count ?
+				index->count * 2 : 1) * sizeof(*entries));
+		if (!entries) {
+			printf("Out of memory.\n");
+			return 0;
+		}
+		index->entries = entries;
+	}
+
+	index->entries[index->count].offset = offset;
+	index->entries[index->count].state = *state;
+	index->count++;
+	return 1;
+}
+
+static int build_index(struct trace_capture *capture,
+		struct trace_index *index)
+{
+	struct trace_decoder decoder;
+	struct capture_block block;
+	uint64_t blocks = 0;
+	int ret;
+
+	trace_decoder_init(&decoder, 0);
+	decoder.first_command = ~0ULL; /* print nothing */
+
+	while ((ret = capture_read_block(capture, &block)) > 0) {
+		if (block.type != CAPTURE_BLOCK_TRACE)
+			continue;
+		if (!(blocks++ % INDEX_INTERVAL) &&
+				!add_entry(index, block.offset, &decoder.state))
+			return 0;
+		trace_decode_report(&decoder, block.data);
+	}
+
+	index->commands = decoder.state.counter;
+	index->duration = trace_decoder_time(&decoder);
+	return ret == 0;
+}
+
+static int load_index(const char *name, struct trace_index *index)
+{
+	unsigned char header[INDEX_HEADER_SIZE];
+	unsigned char raw[INDEX_ENTRY_SIZE];
+	struct index_entry *entries;
+	uint64_t i, count;
+	FILE *f = fopen(name, "rb");
+
+	if (!f)
+		return 0;
+
+	if (fread(header, sizeof(header), 1, f) != 1 ||
+			memcmp(header, INDEX_MAGIC, 8) ||
+			(header[0x08] | header[0x09] << 8) != INDEX_VERSION ||
+			(header[0x0a] | header[0x0b] << 8) != INDEX_ENTRY_SIZE ||
+			get_le32(header + 0x0c) != INDEX_INTERVAL ||
+			get_le64(header + 0x10) != index->size ||
+			get_le64(header + 0x18) != index->mtime) {
+		fclose(f);
+		return 0;
+	}
+
+	count = get_le64(header + 0x20);
+	entries = malloc(count * sizeof(*entries));
+	if (!entries) {
+		fclose(f);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct trace_decoder_state *s = &entries[i].state;
+
+		if (fread(raw, sizeof(raw), 1, f) != 1) {
+			free(entries);
+			fclose(f);
+			return 0;
+		}
+		entries[i].offset = get_le64(raw);
+		s->counter = get_le64(raw + 0x08);
+		s->timestamp = get_le64(raw + 0x10);
+		s->start_timestamp = get_le64(raw + 0x18);
+		s->address = get_le32(raw + 0x20);
+		s->curpos = raw[0x24];
+		s->cmdid = raw[0x25];
+		s->opcode = raw[0x26];
+		s->outbytes = raw[0x27];
+		s->additional_pad_bytes = raw[0x28];
+		s->addr4 = raw[0x29];
+		s->ext_addr = raw[0x2a];
+	}
+	fclose(f);
+
+	index->commands = get_le64(header + 0x28);
+	index->duration = get_le64(header + 0x30);
+	index->count = count;
+	index->entries = entries;
+	return 1;
+}
+
+static void save_index(const char *name, const struct trace_index *index)
+{
+	unsigned char header[INDEX_HEADER_SIZE];
+	unsigned char raw[INDEX_ENTRY_SIZE];
+	uint64_t i;
+	int ok;
+	FILE *f = fopen(name, "wb");
+
+	/* Not fatal, we just have to index again next time. */
+	if (!f) {
+		perror(name);
+		return;
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, INDEX_MAGIC, 8);
+	header[0x08] = INDEX_VERSION;
+	header[0x0a] = INDEX_ENTRY_SIZE;
+	put_le32(header + 0x0c, INDEX_INTERVAL);
+	put_le64(header + 0x10, index->size);
+	put_le64(header + 0x18, index->mtime);
+	put_le64(header + 0x20, index->count);
+	put_le64(header + 0x28, index->commands);
+	put_le64(header + 0x30, index->duration);
+
+	ok = fwrite(header, sizeof(header), 1, f) == 1;
+	for (i = 0; ok && i < index->count; i++) {
+		const struct trace_decoder_state *s = &index->entries[i].state;
+
+		memset(raw, 0, sizeof(raw));
+		put_le64(raw, index->entries[i].offset);
+		put_le64(raw + 0x08, s->counter);
+		put_le64(raw + 0x10, s->timestamp);
+		put_le64(raw + 0x18, s->start_timestamp);
+		put_le32(raw + 0x20, s->address);
+		raw[0x24] = s->curpos;
+		raw[0x25] = s->cmdid;
+		raw[0x26] = s->opcode;
+		raw[0x27] = s->outbytes;
+		raw[0x28] = s->additional_pad_bytes;
+		raw[0x29] = s->addr4;
+		raw[0x2a] = s->ext_addr;
+		ok = fwrite(raw, sizeof(raw), 1, f) == 1;
+	}
+
+	if (fclose(f) || !ok) {
+		printf("Could not write %s\n", name);
+		unlink(name);
+	}
+}
+
+/*
+ * Find the last entry at which no command of the window has been seen
+ * yet. Commands and time only ever increase, so this is a binary search.
+ */
+static uint64_t find_entry(const struct trace_index *index,
+		uint64_t first_command, uint64_t start_time)
+{
+	uint64_t lo = 0, hi = index->count;
+
+	while (hi - lo > 1) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		const struct trace_decoder_state *s =
+				&index->entries[mid].state;
+
+		if (s->counter < first_command || entry_time(s) < start_time)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+#define BENCHMARK_MAX_BYTES	(512 MB)
+#define BENCHMARK_ROUNDS	5
+
+static double seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double decode_all(const unsigned char *reports, uint64_t size,
+		int scalar, struct trace_decoder_state *state)
+{
+	struct trace_decoder decoder;
+	double best = 0;
+	uint64_t pos;
+	int round;
+
+	for (round = 0; round < BENCHMARK_ROUNDS; round++) {
+		double start = seconds(), t;
+
+		trace_decoder_init(&decoder, 0);
+		decoder.quiet = 1;
+		decoder.scalar = scalar;
+		for (pos = 0; pos < size;
+				pos += 2 + ((reports[pos] << 8 | reports[pos + 1])
+					* REPORT_RECORD_LENGTH))
+			trace_decode_report(&decoder, reports + pos);
+
+		t = seconds() - start;
+		if (!round || t < best)
+			best = t;
+	}
+
+	*state = decoder.state;
+	return best;
+}
+
+/* The state is padded, so compare it field by field. */
+static int same_state(const struct trace_decoder_state *a,
+		const struct trace_decoder_state *b)
+{
+	return a->counter == b->counter &&
+		a->timestamp == b->timestamp &&
+		a->start_timestamp == b->start_timestamp &&
+		a->address == b->address &&
+		a->curpos == b->curpos &&
+		a->cmdid == b->cmdid &&
+		a->opcode == b->opcode &&
+		a->outbytes == b->outbytes &&
+		a->additional_pad_bytes == b->additional_pad_bytes &&
+		a->addr4 == b->addr4 &&
+		a->ext_addr == b->ext_addr;
+}
+
+/*
+ * Compare the record scanners and the decoder with and without them on
+ * the trace reports of a capture.
+ */
+static int benchmark(struct trace_capture *capture)
+{
+	struct trace_decoder_state plain, scanned;
+	struct capture_block block;
+	unsigned char *reports = NULL;
+	uint64_t size = 0, allocated = 0, records = 0, pos;
+	uint64_t check, reference = 0;
+	double best, t;
+	int ret, which, round, ok = 1;
+
+	while ((ret = capture_read_block(capture, &block)) > 0 &&
+			size + block.length <= BENCHMARK_MAX_BYTES) {
+		if (block.type != CAPTURE_BLOCK_TRACE)
+			continue;
+		if (size + block.length > allocated) {
+			unsigned char *more;
+
+			allocated = allocated ? allocated * 2 : 1 MB;
+			more = realloc(reports, allocated);
+			if (!more) {
+				printf("Out of memory.\n");
+				free(reports);
+				return 0;
+			}
+			reports = more;
+		}
+		memcpy(reports + size, block.data, block.length);
+		size += block.length;
+		records += (block.data[0] << 8) | block.data[1];
+	}
+	if (ret < 0 || !records) {
+		printf("No SPI trace to benchmark.\n");
+		free(reports);
+		return 0;
+	}
+
+	printf("%llu records, %llu bytes of trace reports\n\n",
+			(unsigned long long)records, (unsigned long long)size);
+
+	for (which = 0; which < TRACE_SCANNERS; which++) {
+		if (!trace_scan_select(which)) {
+			printf("scanner %-8s not supported\n",
+					trace_scan_name(which));
+			continue;
+		}
+
+		for (round = 0; round < BENCHMARK_ROUNDS; round++) {
+			double start = seconds();
+			struct trace_scan scan;
+			unsigned int w, count;
+
+			check = 0;
+			for (pos = 0; pos < size;
+					pos += 2 + count * REPORT_RECORD_LENGTH) {
+				count = reports[pos] << 8 | reports[pos + 1];
+				trace_scan_report(reports + pos + 2, count, 0xff,
+						&scan);
+				for (w = 0; w < TRACE_SCAN_WORDS; w++)
+					check = check * 31 + scan.timestamp[w] * 7 +
+						scan.boundary[w];
+			}
+			t = seconds() - start;
+			if (!round || t < best)
+				best = t;
+		}
+
+		if (which == TRACE_SCAN_SCALAR)
+			reference = check;
+		printf("scanner %-8s %10.1f Mrecords/s%s\n",
+				trace_scan_name(which), records / best / 1e6,
+				check == reference ? "" : "  MISMATCH");
+		if (check != reference)
+			ok = 0;
+	}
+
+	trace_scan_select(-1);
+	t = decode_all(reports, size, 1, &plain);
+	printf("\ndecode scalar         %10.1f Mrecords/s\n",
+			records / t / 1e6);
+	t = decode_all(reports, size, 0, &scanned);
+	printf("decode with %-8s   %10.1f Mrecords/s%s\n",
+			trace_scan_name(-1), records / t / 1e6,
+			same_state(&plain, &scanned) ? "" : "  MISMATCH");
+	if (!same_state(&plain, &scanned))
+		ok = 0;
+
+	free(reports);
+	return ok;
+}
+
+static int parse_range(const char *arg, double scale,
+		unsigned long long *first, unsigned long long *last)
+{
+	char *end;
+	double val = strtod(arg, &end);
+
+	if (end == arg || val < 0)
+		return 0;
+	*first = (unsigned long long)(val * scale);
+
+	if (*end == '\0')
+		return 1;
+	if (*end != ':')
+		return 0;
+
+	arg = end + 1;
+	val = strtod(arg, &end);
+	if (end == arg || *end != '\0' || val < 0)
+		return 0;
+	*last = (unsigned long long)(val * scale);
+
+	return *last >= *first;
+}
+
+static const struct option longopts[] = {
+	{"offset", 1, 0, 'O'},
+	{"commands", 1, 0, 'n'},
+	{"time", 1, 0, 't'},
+	{"stats", 1, 0, 's'},
+	{"fmap", 1, 0, 'm'},
+	{"filter", 1, 0, 'e'},
+	{"reconstruct", 1, 0, 'R'},
+	{"compare", 1, 0, 'c'},
+	{"info", 0, 0, 'i'},
+	{"reindex", 0, 0, 'r'},
+	{"benchmark", 0, 0, 'b'},
+	{"help", 0, 0, 'h'},
+	{NULL, 0, 0, 0}
+};
+
+static void usage(char *name)
+{
+	printf("em100-tracedump: decode EM100pro trace captures\n\nExample:\n"
+		"  %s -n 1200000:1200100 -O 0xff000000 boot.trace\n"
+		"\nUsage: %s [options] CAPTURE\n"
+		"  -O|--offset HEX_VAL:            address offset\n"
+		"  -n|--commands FIRST[:LAST]:     only decode these commands\n"
+		"  -t|--time START[:END]:          only decode this time range (s)\n"
+		"  -s|--stats FILE:                SPI access statistics, CSV or .json\n"
+		"  -m|--fmap FILE:                 image with FMAP for --stats\n"
+		"  -e|--filter EXPR:               only decode matching commands\n"
+		"  -R|--reconstruct FILE:          write the flash data that was read\n"
+		"  -c|--compare FILE:              show which parts of image were read\n"
+		"  -i|--info:                      show capture information\n"
+		"  -r|--reindex:                   rebuild CAPTURE.idx\n"
+		"  -b|--benchmark:                 benchmark the decoder on CAPTURE\n"
+		"  -h|--help:                      this help text\n\n",
+		name, name);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, idx, info = 0, reindex = 0, bench = 0, ret;
+	unsigned long address_offset = 0;
+	unsigned long long first_command = 0, last_command = ~0ULL;
+	unsigned long long start_time = 0, end_time = ~0ULL;
+	struct trace_index index;
+	struct trace_decoder decoder;
+	struct capture_block block;
+	struct trace_capture *capture;
+	const char *filename;
+	const char *stats_filename = NULL, *fmap_filename = NULL;
+	struct trace_stats *stats = NULL;
+	struct trace_filter *filter = NULL;
+	const char *image_filename = NULL, *compare_filename = NULL;
+	struct trace_image *image = NULL;
+	char *index_name;
+	struct stat s;
+
+	while ((opt = getopt_long(argc, argv, "O:n:t:s:m:e:R:c:irbh",
+				  longopts, &idx)) != -1) {
+		switch (opt) {
+		case 'O':
+			sscanf(optarg, "%lx", &address_offset);
+			break;
+		case 'n':
+			if (!parse_range(optarg, 1, &first_command,
+					&last_command)) {
+				printf("Invalid command range: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			if (!parse_range(optarg, TRACE_TICKS_PER_SECOND,
+					&start_time, &end_time)) {
+				printf("Invalid time range: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			stats_filename = optarg;
+			break;
+		case 'm':
+			fmap_filename = optarg;
+			break;
+		case 'e':
+			filter = trace_filter_compile(optarg);
+			if (!filter)
+				return 1;
+			break;
+		case 'R':
+			image_filename = optarg;
+			break;
+		case 'c':
+			compare_filename = optarg;
+			break;
+		case 'i':
+			info = 1;
+			break;
+		case 'r':
+			reindex = 1;
+			break;
+		case 'b':
+			bench = 1;
+			break;
+		default:
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	filename = argv[optind];
+
+	capture = capture_open(filename);
+	if (!capture)
+		return 1;
+
+	if (bench) {
+		ret = benchmark(capture);
+		capture_close(capture);
+		return !ret;
+	}
+
+	if (stat(filename, &s)) {
+		perror(filename);
+		return 1;
+	}
+
+	memset(&index, 0, sizeof(index));
+	index.size = s.st_size;
+	index.mtime = s.st_mtime;
+
+	index_name = malloc(strlen(filename) + 5);
+	if (!index_name) {
+		printf("Out of memory.\n");
+		return 1;
+	}
+	sprintf(index_name, "%s.idx", filename);
+
+	if (reindex || !load_index(index_name, &index)) {
+		printf("Indexing %s ...\n", filename);
+		if (!build_index(capture, &index))
+			return 1;
+		save_index(index_name, &index);
+	}
+	free(index_name);
+
+	if (info) {
+		time_t start = capture->realtime / 1000000000ULL;
+
+		printf("Serial number:    %u\n", capture->serialno);
+		printf("Hardware version: %u\n", capture->hwversion);
+		printf("Started:          %s", ctime(&start));
+		printf("Duration:         %llu.%08llu s\n",
+			(unsigned long long)index.duration /
+			TRACE_TICKS_PER_SECOND,
+			(unsigned long long)index.duration %
+			TRACE_TICKS_PER_SECOND);
+		printf("Commands:         %llu\n",
+				(unsigned long long)index.commands);
+		printf("Index entries:    %llu\n",
+				(unsigned long long)index.count);
+		capture_close(capture);
+		free(index.entries);
+		return 0;
+	}
+
+	if (!index.count) {
+		printf("No SPI trace in %s\n", filename);
+		capture_close(capture);
+		return 0;
+	}
+
+	trace_decoder_init(&decoder, address_offset);
+	decoder.first_command = first_command;
+	decoder.last_command = last_command;
+	decoder.start_time = start_time;
+	decoder.end_time = end_time;
+	decoder.filter = filter;
+
+	if (stats_filename) {
+		stats = trace_stats_create();
+		if (!stats)
+			return 1;
+		if (fmap_filename && !trace_stats_load_fmap(stats,
+				fmap_filename))
+			return 1;
+		decoder.stats = stats;
+		decoder.quiet = 1;
+	}
+
+	if (image_filename || compare_filename) {
+		image = trace_image_create();
+		if (!image)
+			return 1;
+		decoder.image = image;
+		decoder.quiet = 1;
+	}
+
+	idx = find_entry(&index, first_command, start_time);
+	decoder.state = index.entries[idx].state;
+	decoder.muted = 1; /* the command we resume in is before the window */
+	if (!capture_seek(capture, index.entries[idx].offset))
+		return 1;
+
+	while ((ret = capture_read_block(capture, &block)) > 0) {
+		if (block.type != CAPTURE_BLOCK_TRACE)
+			continue;
+		trace_decode_report(&decoder, block.data);
+
+		/* done once a command after the window has started */
+		if (decoder.muted && (decoder.state.counter > last_command ||
+				trace_decoder_time(&decoder) > end_time))
+			break;
+	}
+	printf("\n");
+
+	if (stats) {
+		if (!trace_stats_report(stats, stats_filename))
+			ret = -1;
+		trace_stats_free(stats);
+	}
+
+	if (image) {
+		size_t length = 0;
+
+		if (compare_filename && !stat(compare_filename, &s))
+			length = s.st_size;
+		if (image_filename &&
+				!trace_image_write(image, image_filename, length))
+			ret = -1;
+		if (!trace_image_report(image, compare_filename))
+			ret = -1;
+		trace_image_free(image);
+	}
+
+	trace_filter_free(filter);
+	capture_close(capture);
+	free(index.entries);
+	return ret < 0;
+}
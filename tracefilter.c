@@ -0,0 +1,393 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "em100.h"
+
+/* SPI trace filter
+ *
+ * A filter expression is made of terms
+ *
+ *   addr in LOW..HIGH        address as printed, i.e. with --offset added
+ *   op in {ITEM, ...}        opcode (0x03) or class (read, fastread, ...)
+ *   time in START..END       seconds since the first command
+ *
+ * combined with !, &&, || and parentheses. Either end of a range may be
+ * left out. The expression is compiled once into a postfix program that
+ * the decoder runs for every new command; commands it rejects are muted
+ * like those outside the -n / -t window, so their data is skipped.
+ */
+
+#define FILTER_MAX_DEPTH	64	/* bits in the evaluation stack */
+
+enum {
+	FILTER_ADDR,
+	FILTER_OP,
+	FILTER_TIME,
+	FILTER_NOT,
+	FILTER_AND,
+	FILTER_OR,
+};
+
+struct filter_insn {
+	int type;
+	unsigned long long low, high;
+	uint8_t opcodes[256 / 8];
+};
+
+struct trace_filter {
+	struct filter_insn *insn;
+	unsigned int count, size;
+	unsigned int depth, max_depth;
+};
+
+struct filter_parser {
+	const char *expr;
+	const char *p;
+	struct trace_filter *filter;
+};
+
+static const char *class_names[SPI_CLASSES] = {
+	[SPI_CLASS_OTHER] = "other",
+	[SPI_CLASS_READ] = "read",
+	[SPI_CLASS_FAST_READ] = "fastread",
+	[SPI_CLASS_DUAL_READ] = "dualread",
+	[SPI_CLASS_QUAD_READ] = "quadread",
+	[SPI_CLASS_PROGRAM] = "program",
+	[SPI_CLASS_ERASE] = "erase",
+	[SPI_CLASS_STATUS] = "status",
+	[SPI_CLASS_ID] = "id",
+};
+
+static int parse_error(struct filter_parser *ps, const char *what)
+{
+	printf("Invalid trace filter: expected %s at column %d\n  %s\n  %*s^\n",
+		what, (int)(ps->p - ps->expr) + 1, ps->expr,
+		(int)(ps->p - ps->expr), "");
+	return 0;
+}
+
+static void skip_space(struct filter_parser *ps)
+{
+	while (isspace((unsigned char)*ps->p))
+		ps->p++;
+}
+
+static int accept(struct filter_parser *ps, const char *token)
+{
+	size_t len = strlen(token);
+
+	skip_space(ps);
+	if (strncmp(ps->p, token, len))
+		return 0;
+	ps->p += len;
+	return 1;
+}
+
+/* A name or number. A '.' only belongs to it if it isn't part of ".." */
+static size_t read_word(struct filter_parser *ps, char *word, size_t size)
+{
+	size_t len = 0;
+
+	skip_space(ps);
+	while (isalnum((unsigned char)ps->p[len]) || ps->p[len] == '_' ||
+			(ps->p[len] == '.' && ps->p[len + 1] != '.')) {
+		if (len + 1 < size)
+			word[len] = ps->p[len];
+		len++;
+	}
+	if (len >= size)
+		len = size - 1;
+	word[len] = '\0';
+	return len;
+}
+
+static struct filter_insn *emit(struct filter_parser *ps, int type)
+{
+	struct trace_filter *f = ps->filter;
+	struct filter_insn *insn;
+
+	if (f->count == f->size) {
+		unsigned int size = f->size ? f->size * 2 : 8;
+
+		insn = realloc(f->insn, size * sizeof(*insn));
+		if (!insn) {
+			printf("Out of memory.\n");
+			return NULL;
+		}
+		f->insn = insn;
+		f->size = size;
+	}
+
+	/* terms push a value, operators other than ! pop one */
+	if (type <= FILTER_TIME) {
+		if (++f->depth > f->max_depth)
+			f->max_depth = f->depth;
+	} else if (type != FILTER_NOT) {
+		f->depth--;
+	}
+	if (f->max_depth > FILTER_MAX_DEPTH) {
+		printf("Trace filter is too complex.\n");
+		return NULL;
+	}
+
+	insn = &f->insn[f->count++];
+	memset(insn, 0, sizeof(*insn));
+	insn->type = type;
+	insn->high = ~0ULL;
+	return insn;
+}
+
+/* Returns 0 if there is no number, -1 if it is invalid */
+static int parse_number(struct filter_parser *ps, int time,
+		unsigned long long *val)
+{
+	char word[32], *end;
+
+	if (!read_word(ps, word, sizeof(word)))
+		return 0;
+
+	if (time) {
+		double secs = strtod(word, &end);
+
+		if (*end || secs < 0)
+			return parse_error(ps, "time in seconds") - 1;
+		*val = (unsigned long long)(secs * TRACE_TICKS_PER_SECOND);
+	} else {
+		*val = strtoull(word, &end, 0);
+		if (*end)
+			return parse_error(ps, "number") - 1;
+	}
+	ps->p += strlen(word);
+	return 1;
+}
+
+/* LOW..HIGH, LOW.., ..HIGH or a single value */
+static int parse_range(struct filter_parser *ps, struct filter_insn *insn,
+		int time)
+{
+	int low = parse_number(ps, time, &insn->low);
+
+	if (low < 0)
+		return 0;
+	if (!accept(ps, "..")) {
+		if (!low)
+			return parse_error(ps, "range");
+		insn->high = insn->low;
+		return 1;
+	}
+	if (parse_number(ps, time, &insn->high) < 0)
+		return 0;
+
+	if (insn->high < insn->low)
+		return parse_error(ps, "range with LOW <= HIGH");
+	return 1;
+}
+
+static int parse_opcode(struct filter_parser *ps, struct filter_insn *insn)
+{
+	const char *start;
+	char word[32], *end;
+	unsigned long val;
+	int i, class = -1;
+
+	skip_space(ps);
+	start = ps->p;
+	if (!read_word(ps, word, sizeof(word)))
+		return parse_error(ps, "opcode or command class");
+
+	for (i = 0; i < SPI_CLASSES; i++)
+		if (!strcmp(word, class_names[i]))
+			class = i;
+
+	if (class >= 0) {
+		for (i = 0; i < 256; i++)
+			if (trace_command_class(i) == class)
+				insn->opcodes[i / 8] |= 1 << (i % 8);
+	} else {
+		val = strtoul(word, &end, 0);
+		if (*end || val > 0xff)
+			return parse_error(ps, "opcode or command class");
+		insn->opcodes[val / 8] |= 1 << (val % 8);
+	}
+
+	ps->p = start + strlen(word);
+	return 1;
+}
+
+static int parse_expr(struct filter_parser *ps);
+
+static int parse_term(struct filter_parser *ps)
+{
+	struct filter_insn *insn;
+	char word[8];
+
+	if (accept(ps, "!")) {
+		if (!parse_term(ps))
+			return 0;
+		return emit(ps, FILTER_NOT) != NULL;
+	}
+
+	if (accept(ps, "(")) {
+		if (!parse_expr(ps))
+			return 0;
+		if (!accept(ps, ")"))
+			return parse_error(ps, "')'");
+		return 1;
+	}
+
+	read_word(ps, word, sizeof(word));
+	if (!strcmp(word, "addr")) {
+		ps->p += strlen(word);
+		if (!accept(ps, "in"))
+			return parse_error(ps, "'in'");
+		insn = emit(ps, FILTER_ADDR);
+		return insn && parse_range(ps, insn, 0);
+	}
+
+	if (!strcmp(word, "time")) {
+		ps->p += strlen(word);
+		if (!accept(ps, "in"))
+			return parse_error(ps, "'in'");
+		insn = emit(ps, FILTER_TIME);
+		return insn && parse_range(ps, insn, 1);
+	}
+
+	if (!strcmp(word, "op")) {
+		ps->p += strlen(word);
+		if (!accept(ps, "in"))
+			return parse_error(ps, "'in'");
+		insn = emit(ps, FILTER_OP);
+		if (!insn)
+			return 0;
+		if (!accept(ps, "{"))
+			return parse_opcode(ps, insn);
+		do {
+			if (!parse_opcode(ps, insn))
+				return 0;
+		} while (accept(ps, ","));
+		if (!accept(ps, "}"))
+			return parse_error(ps, "'}'");
+		return 1;
+	}
+
+	return parse_error(ps, "addr, op, time, '!' or '('");
+}
+
+static int parse_and(struct filter_parser *ps)
+{
+	if (!parse_term(ps))
+		return 0;
+	while (accept(ps, "&&")) {
+		if (!parse_term(ps) || !emit(ps, FILTER_AND))
+			return 0;
+	}
+	return 1;
+}
+
+static int parse_expr(struct filter_parser *ps)
+{
+	if (!parse_and(ps))
+		return 0;
+	while (accept(ps, "||")) {
+		if (!parse_and(ps) || !emit(ps, FILTER_OR))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * trace_filter_compile: compile a trace filter expression
+ * @param expr: filter expression, see above
+ *
+ * Returns NULL, after printing what's wrong, if the expression is invalid.
+ */
+struct trace_filter *trace_filter_compile(const char *expr)
+{
+	struct filter_parser ps = { .expr = expr, .p = expr };
+
+	ps.filter = calloc(1, sizeof(*ps.filter));
+	if (!ps.filter) {
+		printf("Out of memory.\n");
+		return NULL;
+	}
+
+	if (!parse_expr(&ps))
+		goto error;
+	skip_space(&ps);
+	if (*ps.p) {
+		parse_error(&ps, "'&&', '||' or end of filter");
+		goto error;
+	}
+	return ps.filter;
+
+error:
+	trace_filter_free(ps.filter);
+	return NULL;
+}
+
+/**
+ * trace_filter_match: run the filter for a new command
+ * @param filter: compiled filter
+ * @param opcode: SPI command byte
+ * @param has_addr: whether the command has an address
+ * @param address: address as printed
+ * @param time: time of the command, see trace_decoder_time()
+ */
+int trace_filter_match(const struct trace_filter *filter, uint8_t opcode,
+		int has_addr, unsigned long long address,
+		unsigned long long time)
+{
+	const struct filter_insn *insn = filter->insn;
+	const struct filter_insn *end = insn + filter->count;
+	uint64_t stack = 0;	/* top of stack in bit 0 */
+
+	for (; insn < end; insn++) {
+		switch (insn->type) {
+		case FILTER_ADDR:
+			stack = (stack << 1) | (has_addr &&
+				address >= insn->low && address <= insn->high);
+			break;
+		case FILTER_OP:
+			stack = (stack << 1) |
+				((insn->opcodes[opcode / 8] >> (opcode % 8)) & 1);
+			break;
+		case FILTER_TIME:
+			stack = (stack << 1) |
+				(time >= insn->low && time <= insn->high);
+			break;
+		case FILTER_NOT:
+			stack ^= 1;
+			break;
+		case FILTER_AND:
+			stack = (stack >> 1) & (stack | ~1ULL);
+			break;
+		case FILTER_OR:
+			stack = (stack >> 1) | (stack & 1);
+			break;
+		}
+	}
+
+	return stack & 1;
+}
+
+void trace_filter_free(struct trace_filter *filter)
+{
+	if (!filter)
+		return;
+	free(filter->insn);
+	free(filter);
+}
@@ -0,0 +1,279 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "em100.h"
+
+/* Flash image reconstruction
+ *
+ * The decoder hands us the data of every read command, which we store
+ * in a sparse memory model of the 32 bit SPI address space: a table of
+ * 1024 page tables, each covering 4MB in 4KB pages. Pages are allocated
+ * when they are first read, and each page has a bitmap of the bytes the
+ * host actually fetched.
+ */
+
+#define IMAGE_PAGE_SHIFT	12
+#define IMAGE_PAGE_SIZE		(1 << IMAGE_PAGE_SHIFT)
+#define IMAGE_TABLE_SHIFT	10
+#define IMAGE_TABLE_PAGES	(1 << IMAGE_TABLE_SHIFT)
+#define IMAGE_TABLES		(1 << (32 - IMAGE_PAGE_SHIFT - IMAGE_TABLE_SHIFT))
+#define IMAGE_MAX_MISMATCHES	10
+
+struct image_page {
+	uint64_t covered[IMAGE_PAGE_SIZE / 64];
+	unsigned char data[IMAGE_PAGE_SIZE];
+};
+
+struct trace_image {
+	struct image_page **tables[IMAGE_TABLES];
+	uint64_t pages;
+	uint64_t end;		/* highest fetched address + 1 */
+};
+
+struct trace_image *trace_image_create(void)
+{
+	struct trace_image *image = calloc(1, sizeof(*image));
+
+	if (!image)
+		printf("Out of memory.\n");
+	return image;
+}
+
+static struct image_page *find_page(const struct trace_image *image,
+		uint32_t page)
+{
+	struct image_page **table = image->tables[page >> IMAGE_TABLE_SHIFT];
+
+	if (!table)
+		return NULL;
+	return table[page & (IMAGE_TABLE_PAGES - 1)];
+}
+
+static struct image_page *get_page(struct trace_image *image, uint32_t page)
+{
+	struct image_page ***table = &image->tables[page >> IMAGE_TABLE_SHIFT];
+	struct image_page **p;
+
+	if (!*table) {
+		*table = calloc(IMAGE_TABLE_PAGES, sizeof(**table));
+		if (!*table)
+			return NULL;
+	}
+
+	p = &(*table)[page & (IMAGE_TABLE_PAGES - 1)];
+	if (!*p) {
+		*p = calloc(1, sizeof(**p));
+		if (!*p)
+			return NULL;
+		memset((*p)->data, 0xff, IMAGE_PAGE_SIZE);
+		image->pages++;
+	}
+	return *p;
+}
+
+/**
+ * trace_image_data: store data the host read from flash
+ * @param image: image to update
+ * @param address: flash address of the first byte
+ * @param data: the bytes as seen on the bus
+ * @param length: number of bytes
+ */
+void trace_image_data(struct trace_image *image, uint32_t address,
+		const unsigned char *data, unsigned int length)
+{
+	while (length) {
+		unsigned int offset = address & (IMAGE_PAGE_SIZE - 1);
+		unsigned int len = IMAGE_PAGE_SIZE - offset;
+		struct image_page *page;
+		unsigned int i;
+
+		if (len > length)
+			len = length;
+
+		page = get_page(image, address >> IMAGE_PAGE_SHIFT);
+		if (!page)
+			return; /* out of memory, the report will be short */
+
+		memcpy(page->data + offset, data, len);
+		for (i = offset; i < offset + len; i++)
+			page->covered[i / 64] |= 1ULL << (i % 64);
+
+		if ((uint64_t)address + len > image->end)
+			image->end = (uint64_t)address + len;
+
+		address += len;
+		data += len;
+		length -= len;
+	}
+}
+
+static unsigned int covered_bytes(const struct image_page *page)
+{
+	unsigned int i, bytes = 0;
+
+	for (i = 0; i < IMAGE_PAGE_SIZE / 64; i++)
+		bytes += __builtin_popcountll(page->covered[i]);
+	return bytes;
+}
+
+/**
+ * trace_image_write: write the reconstructed image
+ * @param image: reconstructed image
+ * @param filename: file to write
+ * @param length: size of the file, 0 to end after the last fetched byte
+ *
+ * Bytes that were never read are 0xff.
+ */
+int trace_image_write(struct trace_image *image, const char *filename,
+		size_t length)
+{
+	struct image out;
+	size_t offset;
+
+	if (!length)
+		length = (image->end + IMAGE_PAGE_SIZE - 1) &
+				~(uint64_t)(IMAGE_PAGE_SIZE - 1);
+	if (!length) {
+		printf("No flash reads to reconstruct.\n");
+		return 0;
+	}
+
+	if (!image_create(&out, filename, length))
+		return 0;
+
+	for (offset = 0; offset < length; offset += IMAGE_PAGE_SIZE) {
+		const struct image_page *page = find_page(image,
+				offset >> IMAGE_PAGE_SHIFT);
+		size_t len = length - offset < IMAGE_PAGE_SIZE ?
+				length - offset : IMAGE_PAGE_SIZE;
+
+		if (page)
+			memcpy(out.data + offset, page->data, len);
+		else
+			memset(out.data + offset, 0xff, len);
+	}
+
+	if (!image_close(&out))
+		return 0;
+
+	printf("Wrote %zu bytes to %s\n", length, filename);
+	return 1;
+}
+
+/**
+ * trace_image_report: print which parts of the flash were read
+ * @param image: reconstructed image
+ * @param filename: image that was emulated, or NULL
+ *
+ * With the emulated image, fetched data that differs from it is
+ * reported too, which means the file isn't what the EM100Pro served.
+ * Addresses are flash addresses, --offset does not apply to them.
+ */
+int trace_image_report(struct trace_image *image, const char *filename)
+{
+	struct image ref = { 0 };
+	uint64_t page, pages, end = image->end;
+	uint64_t covered = 0, mismatches = 0, run_start = 0, in_ref = 0;
+	int in_run = 0;
+
+	if (filename) {
+		if (!image_load(&ref, filename, 256 MB))
+			return 0;
+		if (ref.length > end)
+			end = ref.length;
+	}
+
+	printf("Fetched pages:\n");
+	pages = (end + IMAGE_PAGE_SIZE - 1) >> IMAGE_PAGE_SHIFT;
+	for (page = 0; page <= pages; page++) {
+		const struct image_page *p = page < pages ?
+				find_page(image, page) : NULL;
+		uint64_t base = page << IMAGE_PAGE_SHIFT;
+
+		if (p && !in_run) {
+			run_start = base;
+			in_run = 1;
+		} else if (!p && in_run) {
+			printf("  %08llx-%08llx  %6llu KB\n",
+				(unsigned long long)run_start,
+				(unsigned long long)base - 1,
+				(unsigned long long)(base - run_start) / 1024);
+			in_run = 0;
+		}
+		if (!p)
+			continue;
+
+		covered += covered_bytes(p);
+		if (base < ref.length)
+			in_ref++;
+	}
+
+	for (page = 0; page << IMAGE_PAGE_SHIFT < ref.length; page++) {
+		const struct image_page *p = find_page(image, page);
+		uint64_t base = page << IMAGE_PAGE_SHIFT;
+		unsigned int i;
+
+		if (!p)
+			continue;
+
+		for (i = 0; i < IMAGE_PAGE_SIZE && base + i < ref.length; i++) {
+			if (!(p->covered[i / 64] & (1ULL << (i % 64))) ||
+					p->data[i] == ref.data[base + i])
+				continue;
+			if (++mismatches <= IMAGE_MAX_MISMATCHES)
+				printf("Mismatch at %08llx: read %02x, "
+					"image has %02x\n",
+					(unsigned long long)base + i,
+					p->data[i], ref.data[base + i]);
+		}
+	}
+
+	printf("%llu pages (%llu KB) touched, %llu bytes fetched",
+		(unsigned long long)image->pages,
+		(unsigned long long)image->pages * IMAGE_PAGE_SIZE / 1024,
+		(unsigned long long)covered);
+	if (filename) {
+		uint64_t ref_pages = (ref.length + IMAGE_PAGE_SIZE - 1) >>
+				IMAGE_PAGE_SHIFT;
+
+		printf(", %.1f%% of %s", ref_pages ?
+			100.0 * in_ref / ref_pages : 0.0, filename);
+		if (mismatches)
+			printf(", %llu bytes differ",
+				(unsigned long long)mismatches);
+		image_close(&ref);
+	}
+	printf("\n");
+
+	return 1;
+}
+
+void trace_image_free(struct trace_image *image)
+{
+	unsigned int i, j;
+
+	if (!image)
+		return;
+
+	for (i = 0; i < IMAGE_TABLES; i++) {
+		if (!image->tables[i])
+			continue;
+		for (j = 0; j < IMAGE_TABLE_PAGES; j++)
+			free(image->tables[i][j]);
+		free(image->tables[i]);
+	}
+	free(image);
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "em100.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SCAN 1
+#endif
+
+/* SPI trace record scanner
+ *
+ * Before a report is decoded, its records are scanned for timestamps
+ * (command id 0xff) and for records whose command id differs from the
+ * record before. Everything in between is guaranteed to be data of the
+ * current command, which the decoder can skip in one go when it is not
+ * printing. The command id is the first byte of every 8 byte record, so
+ * the vector versions gather those bytes into a register and compare 16
+ * or 32 records at a time.
+ */
+
+typedef void (*scan_fn)(const unsigned char *records, unsigned int count,
+		unsigned char prev, struct trace_scan *scan);
+
+static void set_bits(struct trace_scan *scan, unsigned int i,
+		uint64_t timestamp, uint64_t boundary)
+{
+	scan->timestamp[i / 64] |= timestamp << (i % 64);
+	scan->boundary[i / 64] |= boundary << (i % 64);
+}
+
+/* records [i, count) one at a time */
+static void scan_records(const unsigned char *records, unsigned int i,
+		unsigned int count, unsigned char prev, struct trace_scan *scan)
+{
+	for (; i < count; i++) {
+		unsigned char cmd = records[i * REPORT_RECORD_LENGTH];
+
+		set_bits(scan, i, cmd == 0xff, cmd != prev);
+		prev = cmd;
+	}
+}
+
+static void scan_scalar(const unsigned char *records, unsigned int count,
+		unsigned char prev, struct trace_scan *scan)
+{
+	scan_records(records, 0, count, prev, scan);
+}
+
+#if defined(HAVE_X86_SCAN) && defined(__SSE2__)
+static void scan_sse2(const unsigned char *records, unsigned int count,
+		unsigned char prev, struct trace_scan *scan)
+{
+	const __m128i lowbyte = _mm_set1_epi64x(0xff);
+	const __m128i ff = _mm_set1_epi8(-1);
+	unsigned int i, k;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		const unsigned char *p = records + i * REPORT_RECORD_LENGTH;
+		__m128i v[8], w0, w1, w2, w3, cmds, last;
+		unsigned int ts, eq;
+
+		/* two records per load, keep the command id of each */
+		for (k = 0; k < 8; k++)
+			v[k] = _mm_and_si128(lowbyte,
+				_mm_loadu_si128((const __m128i *)(p + k * 16)));
+
+		/* narrow 64 -> 32 -> 16 -> 8 bits, keeping the order */
+		w0 = _mm_packs_epi32(v[0], v[1]);
+		w1 = _mm_packs_epi32(v[2], v[3]);
+		w2 = _mm_packs_epi32(v[4], v[5]);
+		w3 = _mm_packs_epi32(v[6], v[7]);
+		cmds = _mm_packus_epi16(_mm_packs_epi32(w0, w1),
+				_mm_packs_epi32(w2, w3));
+
+		last = _mm_or_si128(_mm_slli_si128(cmds, 1),
+				_mm_cvtsi32_si128(prev));
+
+		ts = _mm_movemask_epi8(_mm_cmpeq_epi8(cmds, ff));
+		eq = _mm_movemask_epi8(_mm_cmpeq_epi8(cmds, last));
+		set_bits(scan, i, ts, ~eq & 0xffff);
+
+		prev = p[15 * REPORT_RECORD_LENGTH];
+	}
+
+	scan_records(records, i, count, prev, scan);
+}
+#endif
+
+#ifdef HAVE_X86_SCAN
+__attribute__((target("avx2")))
+static void scan_avx2(const unsigned char *records, unsigned int count,
+		unsigned char prev, struct trace_scan *scan)
+{
+	const __m256i offsets = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56);
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	const __m256i lowbyte = _mm256_set1_epi32(0xff);
+	const __m256i ff = _mm256_set1_epi8(-1);
+	unsigned int i, k;
+
+	for (i = 0; i + 32 <= count; i += 32) {
+		const unsigned char *p = records + i * REPORT_RECORD_LENGTH;
+		__m256i g[4], cmds, last;
+		uint32_t ts, eq;
+
+		/* eight records per gather, keep the command id of each */
+		for (k = 0; k < 4; k++)
+			g[k] = _mm256_and_si256(lowbyte, _mm256_i32gather_epi32(
+				(const int *)(p + k * 64), offsets, 1));
+
+		/* narrow to bytes; packing works per 128 bit lane */
+		cmds = _mm256_packus_epi16(_mm256_packus_epi32(g[0], g[1]),
+				_mm256_packus_epi32(g[2], g[3]));
+		cmds = _mm256_permutevar8x32_epi32(cmds, order);
+
+		/* shift in the previous command id, across lanes */
+		last = _mm256_alignr_epi8(cmds,
+				_mm256_permute2x128_si256(cmds, cmds, 0x08), 15);
+		last = _mm256_or_si256(last, _mm256_setr_epi32(prev,
+				0, 0, 0, 0, 0, 0, 0));
+
+		ts = _mm256_movemask_epi8(_mm256_cmpeq_epi8(cmds, ff));
+		eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(cmds, last));
+		set_bits(scan, i, ts, ~eq);
+
+		prev = p[31 * REPORT_RECORD_LENGTH];
+	}
+
+	scan_records(records, i, count, prev, scan);
+}
+#endif
+
+static const char *scanner_names[] = {
+	[TRACE_SCAN_SCALAR] = "scalar",
+	[TRACE_SCAN_SSE2] = "sse2",
+	[TRACE_SCAN_AVX2] = "avx2",
+};
+
+static int scanner = -1;
+static scan_fn scan_impl;
+
+/**
+ * trace_scan_select: choose the scanner implementation
+ * @param which: TRACE_SCAN_*, or -1 for the fastest one available
+ *
+ * Returns 0 if the implementation is not supported on this machine.
+ */
+int trace_scan_select(int which)
+{
+	if (which < 0) {
+		return trace_scan_select(TRACE_SCAN_AVX2) ||
+			trace_scan_select(TRACE_SCAN_SSE2) ||
+			trace_scan_select(TRACE_SCAN_SCALAR);
+	}
+
+	switch (which) {
+	case TRACE_SCAN_SCALAR:
+		scan_impl = scan_scalar;
+		break;
+#if defined(HAVE_X86_SCAN) && defined(__SSE2__)
+	case TRACE_SCAN_SSE2:
+		scan_impl = scan_sse2;
+		break;
+#endif
+#ifdef HAVE_X86_SCAN
+	case TRACE_SCAN_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return 0;
+		scan_impl = scan_avx2;
+		break;
+#endif
+	default:
+		return 0;
+	}
+
+	scanner = which;
+	return 1;
+}
+
+/**
+ * trace_scan_name: name of a scanner implementation
+ * @param which: TRACE_SCAN_*, or -1 for the selected one
+ */
+const char *trace_scan_name(int which)
+{
+	if (which < 0) {
+		if (scanner < 0)
+			trace_scan_select(-1);
+		which = scanner;
+	}
+	return scanner_names[which];
+}
+
+/**
+ * trace_scan_report: find timestamps and command boundaries in a report
+ * @param records: first record of the report
+ * @param count: number of records
+ * @param prev: command id of the last data record before the report
+ * @param scan: bitmasks, bit n describes record n
+ *
+ * Only the first REPORT_MAX_RECORDS records fit into the bitmasks, any
+ * more are ignored.
+ */
+void trace_scan_report(const unsigned char *records, unsigned int count,
+		unsigned char prev, struct trace_scan *scan)
+{
+	if (!scan_impl)
+		trace_scan_select(-1);
+
+	if (count > REPORT_MAX_RECORDS)
+		count = REPORT_MAX_RECORDS;
+
+	memset(scan, 0, sizeof(*scan));
+	scan_impl(records, count, prev, scan);
+}
@@ -0,0 +1,538 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "em100.h"
+
+/* SPI trace statistics
+ *
+ * The decoder feeds every command and data record in here, and we keep
+ * per 4KB page counters, so the cost per record is constant no matter
+ * how long the trace runs. Like the trace image, the pages live in a
+ * sparse table of 1024 page tables covering 4MB each, allocated when an
+ * address in their range is first seen. FMAP regions are only resolved
+ * when the report is written, by adding up the pages they cover.
+ */
+
+#define STATS_PAGE_SHIFT	12
+#define STATS_PAGE_SIZE		(1 << STATS_PAGE_SHIFT)
+#define STATS_TABLE_SHIFT	10
+#define STATS_TABLE_PAGES	(1 << STATS_TABLE_SHIFT)
+#define STATS_TABLES		(1 << (32 - STATS_PAGE_SHIFT - STATS_TABLE_SHIFT))
+#define STATS_TOP_PAGES		10
+
+enum {
+	STATS_READ,
+	STATS_FAST_READ,
+	STATS_DUAL_READ,
+	STATS_QUAD_READ,
+	STATS_OTHER,
+	STATS_CLASSES
+};
+
+static const char *class_names[STATS_CLASSES] = {
+	"read", "fast_read", "dual_read", "quad_read", "other"
+};
+
+struct page_stats {
+	uint64_t commands[STATS_CLASSES];
+	uint64_t bytes;
+	uint64_t accesses;
+	uint64_t first, last;
+};
+
+struct fmap_region {
+	char name[33];
+	uint32_t offset;
+	uint32_t size;
+};
+
+struct trace_stats {
+	struct page_stats *tables[STATS_TABLES];
+
+	/* command the data records belong to */
+	uint8_t opcode;
+	int uses_address;
+	uint64_t time;
+
+	uint64_t opcode_commands[256];
+	uint64_t opcode_bytes[256];
+	uint64_t commands, bytes;
+	uint64_t duration;
+
+	struct fmap_region *regions;
+	unsigned int region_count;
+};
+
+/* FMAP as defined by flashmap, all values little endian */
+#define FMAP_SIGNATURE		"__FMAP__"
+#define FMAP_STRLEN		32
+
+typedef struct {
+	uint8_t  signature[8];
+	uint8_t  ver_major;
+	uint8_t  ver_minor;
+	uint64_t base;
+	uint32_t size;
+	uint8_t  name[FMAP_STRLEN];
+	uint16_t nareas;
+} __attribute__((packed)) fmap_t;
+
+typedef struct {
+	uint32_t offset;
+	uint32_t size;
+	uint8_t  name[FMAP_STRLEN];
+	uint16_t flags;
+} __attribute__((packed)) fmap_area_t;
+
+/**
+ * trace_stats_create: start collecting SPI trace statistics
+ */
+struct trace_stats *trace_stats_create(void)
+{
+	struct trace_stats *stats = calloc(1, sizeof(*stats));
+
+	if (!stats)
+		printf("Out of memory.\n");
+	return stats;
+}
+
+/**
+ * trace_stats_load_fmap: report statistics per FMAP region
+ * @param stats: statistics
+ * @param filename: flash image containing an FMAP
+ */
+int trace_stats_load_fmap(struct trace_stats *stats, const char *filename)
+{
+	struct image image;
+	fmap_t *fmap = NULL;
+	fmap_area_t *area;
+	size_t i;
+
+	if (!image_load(&image, filename, 256 MB))
+		return 0;
+
+	for (i = 0; i + sizeof(fmap_t) <= image.length; i += 4) {
+		fmap_t *f = (fmap_t *)(image.data + i);
+
+		if (!memcmp(f->signature, FMAP_SIGNATURE, 8) &&
+				f->ver_major == 1 &&
+				i + sizeof(fmap_t) + f->nareas *
+				sizeof(fmap_area_t) <= image.length) {
+			fmap = f;
+			break;
+		}
+	}
+
+	if (!fmap) {
+		printf("No FMAP found in %s\n", filename);
+		image_close(&image);
+		return 0;
+	}
+
+	stats->regions = calloc(fmap->nareas, sizeof(*stats->regions));
+	if (!stats->regions) {
+		printf("Out of memory.\n");
+		image_close(&image);
+		return 0;
+	}
+
+	area = (fmap_area_t *)(fmap + 1);
+	for (i = 0; i < fmap->nareas; i++) {
+		memcpy(stats->regions[i].name, area[i].name, FMAP_STRLEN);
+		stats->regions[i].offset = area[i].offset;
+		stats->regions[i].size = area[i].size;
+	}
+	stats->region_count = fmap->nareas;
+
+	image_close(&image);
+	return 1;
+}
+
+static struct page_stats *get_page(struct trace_stats *stats,
+		uint32_t address)
+{
+	uint32_t page = address >> STATS_PAGE_SHIFT;
+	struct page_stats **table = &stats->tables[page >> STATS_TABLE_SHIFT];
+
+	if (!*table) {
+		*table = calloc(STATS_TABLE_PAGES, sizeof(**table));
+		if (!*table)
+			return NULL;
+	}
+
+	return &(*table)[page & (STATS_TABLE_PAGES - 1)];
+}
+
+/* Find the first accessed page at or after *page, skipping empty tables */
+static struct page_stats *next_page(const struct trace_stats *stats,
+		uint64_t *page)
+{
+	for (; *page < (uint64_t)STATS_TABLES * STATS_TABLE_PAGES; (*page)++) {
+		struct page_stats *table =
+			stats->tables[*page >> STATS_TABLE_SHIFT];
+		struct page_stats *p;
+
+		if (!table) {
+			*page |= STATS_TABLE_PAGES - 1;
+			continue;
+		}
+		p = &table[*page & (STATS_TABLE_PAGES - 1)];
+		if (p->accesses)
+			return p;
+	}
+	return NULL;
+}
+
+static void touch(struct page_stats *page, uint64_t time)
+{
+	if (!page->accesses++)
+		page->first = time;
+	page->last = time;
+}
+
+static int command_class(uint8_t opcode)
+{
+	switch (trace_command_class(opcode)) {
+	case SPI_CLASS_READ:
+		return STATS_READ;
+	case SPI_CLASS_FAST_READ:
+		return STATS_FAST_READ;
+	case SPI_CLASS_DUAL_READ:
+		return STATS_DUAL_READ;
+	case SPI_CLASS_QUAD_READ:
+		return STATS_QUAD_READ;
+	default:
+		return STATS_OTHER;
+	}
+}
+
+/**
+ * trace_stats_command: account a new SPI command
+ * @param stats: statistics
+ * @param opcode: SPI command byte
+ * @param uses_address: whether address is valid
+ * @param address: flash address of the command
+ * @param time: trace time of the command
+ */
+void trace_stats_command(struct trace_stats *stats, uint8_t opcode,
+		int uses_address, uint32_t address, uint64_t time)
+{
+	stats->opcode = opcode;
+	stats->uses_address = uses_address;
+	stats->time = time;
+	stats->duration = time;
+
+	stats->opcode_commands[opcode]++;
+	stats->commands++;
+
+	if (uses_address) {
+		struct page_stats *page = get_page(stats, address);
+
+		if (page) {
+			page->commands[command_class(opcode)]++;
+			touch(page, time);
+		}
+	}
+}
+
+/**
+ * trace_stats_data: account data bytes of the current command
+ * @param stats: statistics
+ * @param address: flash address of the first byte
+ * @param length: number of bytes
+ */
+void trace_stats_data(struct trace_stats *stats, uint32_t address,
+		unsigned int length)
+{
+	stats->opcode_bytes[stats->opcode] += length;
+	stats->bytes += length;
+
+	if (!stats->uses_address)
+		return;
+
+	/* a record can cross a page boundary */
+	while (length) {
+		struct page_stats *page = get_page(stats, address);
+		unsigned int len = STATS_PAGE_SIZE -
+				(address & (STATS_PAGE_SIZE - 1));
+
+		if (len > length)
+			len = length;
+		if (page) {
+			page->bytes += len;
+			touch(page, stats->time);
+		}
+		address += len;
+		length -= len;
+	}
+}
+
+/* Add up the pages of a flash range */
+static void sum_pages(struct trace_stats *stats, uint32_t offset,
+		uint32_t size, struct page_stats *sum)
+{
+	uint64_t page, end = ((uint64_t)offset + size + STATS_PAGE_SIZE - 1)
+			>> STATS_PAGE_SHIFT;
+	struct page_stats *p;
+	int c;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (page = offset >> STATS_PAGE_SHIFT;
+			(p = next_page(stats, &page)) && page < end; page++) {
+		for (c = 0; c < STATS_CLASSES; c++)
+			sum->commands[c] += p->commands[c];
+		sum->bytes += p->bytes;
+		if (!sum->accesses || p->first < sum->first)
+			sum->first = p->first;
+		if (p->last > sum->last)
+			sum->last = p->last;
+		sum->accesses += p->accesses;
+	}
+}
+
+static void print_time(FILE *f, uint64_t time)
+{
+	fprintf(f, "%llu.%08llu",
+		(unsigned long long)(time / TRACE_TICKS_PER_SECOND),
+		(unsigned long long)(time % TRACE_TICKS_PER_SECOND));
+}
+
+static void print_row(const char *name, uint32_t offset, uint32_t size,
+		const struct page_stats *p)
+{
+	printf("  %-20s %08x %8x %9llu %9llu %9llu %9llu %9llu %12llu ",
+		name, offset, size,
+		(unsigned long long)p->commands[STATS_READ],
+		(unsigned long long)p->commands[STATS_FAST_READ],
+		(unsigned long long)p->commands[STATS_DUAL_READ],
+		(unsigned long long)p->commands[STATS_QUAD_READ],
+		(unsigned long long)p->commands[STATS_OTHER],
+		(unsigned long long)p->bytes);
+	if (p->accesses) {
+		print_time(stdout, p->first);
+		printf(" ");
+		print_time(stdout, p->last);
+	}
+	printf("\n");
+}
+
+static void print_summary(struct trace_stats *stats)
+{
+	unsigned int i, op;
+
+	printf("\nSPI trace statistics: %llu commands, %llu bytes, ",
+		(unsigned long long)stats->commands,
+		(unsigned long long)stats->bytes);
+	print_time(stdout, stats->duration);
+	printf(" s\n\nCommand mix:\n");
+
+	for (op = 0; op < 256; op++) {
+		if (!stats->opcode_commands[op])
+			continue;
+		printf("  0x%02x %-24s %12llu commands %12llu bytes\n", op,
+			trace_command_name(op),
+			(unsigned long long)stats->opcode_commands[op],
+			(unsigned long long)stats->opcode_bytes[op]);
+	}
+
+	printf("\n  %-20s %-8s %8s %9s %9s %9s %9s %9s %12s "
+		"first/last access\n",
+		stats->region_count ? "region" : "page", "offset", "size",
+		"read", "fast", "dual", "quad", "other", "bytes");
+
+	if (stats->region_count) {
+		for (i = 0; i < stats->region_count; i++) {
+			struct fmap_region *r = &stats->regions[i];
+			struct page_stats sum;
+
+			sum_pages(stats, r->offset, r->size, &sum);
+			print_row(r->name, r->offset, r->size, &sum);
+		}
+		return;
+	}
+
+	/* Without an FMAP, show the pages that moved the most data */
+	uint64_t shown[STATS_TOP_PAGES], page;
+	struct page_stats *p;
+	unsigned int n;
+
+	for (n = 0; n < STATS_TOP_PAGES; n++) {
+		struct page_stats *best = NULL;
+		uint64_t best_page = 0;
+
+		for (page = 0; (p = next_page(stats, &page)); page++) {
+			unsigned int k;
+
+			if (best && p->bytes <= best->bytes)
+				continue;
+			for (k = 0; k < n && shown[k] != page; k++)
+				;
+			if (k == n) {
+				best = p;
+				best_page = page;
+			}
+		}
+		if (!best)
+			break;
+		shown[n] = best_page;
+		print_row("", best_page << STATS_PAGE_SHIFT, STATS_PAGE_SIZE,
+				best);
+	}
+}
+
+static void write_csv(struct trace_stats *stats, FILE *f)
+{
+	struct page_stats *p;
+	uint64_t page;
+	int c;
+
+	fprintf(f, "address");
+	for (c = 0; c < STATS_CLASSES; c++)
+		fprintf(f, ",%s", class_names[c]);
+	fprintf(f, ",bytes,first,last\n");
+
+	for (page = 0; (p = next_page(stats, &page)); page++) {
+		fprintf(f, "0x%08x", (uint32_t)(page << STATS_PAGE_SHIFT));
+		for (c = 0; c < STATS_CLASSES; c++)
+			fprintf(f, ",%llu", (unsigned long long)p->commands[c]);
+		fprintf(f, ",%llu,", (unsigned long long)p->bytes);
+		print_time(f, p->first);
+		fprintf(f, ",");
+		print_time(f, p->last);
+		fprintf(f, "\n");
+	}
+}
+
+static void write_json_stats(FILE *f, const struct page_stats *p)
+{
+	int c;
+
+	for (c = 0; c < STATS_CLASSES; c++)
+		fprintf(f, ", \"%s\": %llu", class_names[c],
+				(unsigned long long)p->commands[c]);
+	fprintf(f, ", \"bytes\": %llu, \"first\": ",
+			(unsigned long long)p->bytes);
+	print_time(f, p->first);
+	fprintf(f, ", \"last\": ");
+	print_time(f, p->last);
+}
+
+static void write_json(struct trace_stats *stats, FILE *f)
+{
+	const char *sep = "";
+	struct page_stats *p;
+	uint64_t page;
+	unsigned int i;
+
+	fprintf(f, "{\n  \"commands\": %llu,\n  \"bytes\": %llu,\n"
+		"  \"duration\": ", (unsigned long long)stats->commands,
+		(unsigned long long)stats->bytes);
+	print_time(f, stats->duration);
+
+	fprintf(f, ",\n  \"opcodes\": [");
+	for (i = 0; i < 256; i++) {
+		if (!stats->opcode_commands[i])
+			continue;
+		fprintf(f, "%s\n    { \"opcode\": %u, \"name\": \"%s\", "
+			"\"commands\": %llu, \"bytes\": %llu }", sep, i,
+			trace_command_name(i),
+			(unsigned long long)stats->opcode_commands[i],
+			(unsigned long long)stats->opcode_bytes[i]);
+		sep = ",";
+	}
+
+	fprintf(f, "\n  ],\n  \"regions\": [");
+	sep = "";
+	for (i = 0; i < stats->region_count; i++) {
+		struct fmap_region *r = &stats->regions[i];
+		struct page_stats sum;
+		const char *c;
+
+		sum_pages(stats, r->offset, r->size, &sum);
+		fprintf(f, "%s\n    { \"name\": \"", sep);
+		for (c = r->name; *c; c++)
+			fprintf(f, (*c == '"' || *c == '\\') ? "\\%c" : "%c",
+					*c);
+		fprintf(f, "\", \"offset\": %u, \"size\": %u",
+				r->offset, r->size);
+		write_json_stats(f, &sum);
+		fprintf(f, " }");
+		sep = ",";
+	}
+
+	fprintf(f, "\n  ],\n  \"pages\": [");
+	sep = "";
+	for (page = 0; (p = next_page(stats, &page)); page++) {
+		fprintf(f, "%s\n    { \"address\": %u", sep,
+				(uint32_t)(page << STATS_PAGE_SHIFT));
+		write_json_stats(f, p);
+		fprintf(f, " }");
+		sep = ",";
+	}
+	fprintf(f, "\n  ]\n}\n");
+}
+
+/**
+ * trace_stats_report: print a summary and write the histogram
+ * @param stats: statistics
+ * @param filename: histogram file, JSON if it ends in .json, else CSV.
+ *                  May be NULL.
+ */
+int trace_stats_report(struct trace_stats *stats, const char *filename)
+{
+	size_t len;
+	FILE *f;
+
+	print_summary(stats);
+
+	if (!filename)
+		return 1;
+
+	f = fopen(filename, "w");
+	if (!f) {
+		perror(filename);
+		return 0;
+	}
+
+	len = strlen(filename);
+	if (len >= 5 && !strcasecmp(filename + len - 5, ".json"))
+		write_json(stats, f);
+	else
+		write_csv(stats, f);
+
+	if (fclose(f)) {
+		perror(filename);
+		return 0;
+	}
+	printf("\nWrote %s\n", filename);
+	return 1;
+}
+
+/**
+ * trace_stats_free: release statistics
+ * @param stats: statistics
+ */
+void trace_stats_free(struct trace_stats *stats)
+{
+	unsigned int i;
+
+	for (i = 0; i < STATS_TABLES; i++)
+		free(stats->tables[i]);
+	free(stats->regions);
+	free(stats);
+}
@@ -12,25 +12,309 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "em100.h"
 
 /* USB communication */
 
-int send_cmd(libusb_device_handle *dev, void *data)
+/*
+ * Asynchronous transfer engine
+ *
+ * Requests are put on a FIFO submission queue and moved into a pool of
+ * USB_MAX_INFLIGHT libusb transfers as soon as one becomes available.
+ * Since the queue is strictly ordered, requests on the same endpoint
+ * reach the device in the order they were submitted.
+ *
+ * send_cmd() only waits until its command has been handed to libusb,
+ * so a series of commands that do not expect an answer (e.g. a chip
+ * init sequence) is pipelined instead of costing a full round trip
+ * each. Its return value therefore only says whether the command could
+ * be queued. A command that fails on the wire later is reported with
+ * its opcode when it completes, and counted for send_cmd_flush().
+ * Commands without a response call send_cmd_flush() before they report
+ * success, so only sequences that raw send_cmd() calls are pipelined
+ * for share the round trip. get_response() waits for its data.
+ *
+ * The engine is not thread safe. Only one thread may talk to the
+ * EM100Pro at any time.
+ */
+
+#define USB_MAX_INFLIGHT	16
+#define USB_CMD_SLOTS		32
+#define USB_CMD_LENGTH		16 /* haven't seen any other length yet */
+
+static struct {
+	libusb_context *ctx;
+	libusb_device_handle *dev;
+
+	struct libusb_transfer *pool[USB_MAX_INFLIGHT];
+	int free_transfers;
+
+	/* submission queue */
+	struct usb_request *head, *tail;
+	int pending;
+
+	/* buffers for fire-and-forget commands */
+	struct usb_request cmd[USB_CMD_SLOTS];
+	unsigned char cmd_data[USB_CMD_SLOTS][USB_CMD_LENGTH];
+	unsigned int cmd_next;
+
+	/* failed commands since the last send_cmd_flush() */
+	int errors;
+} usb;
+
+static void usb_pump(void);
+
+static void usb_transfer_cb(struct libusb_transfer *transfer)
 {
-	int actual;
-	int length = 16; /* haven't seen any other length yet */
-	libusb_bulk_transfer(dev, 1 | LIBUSB_ENDPOINT_OUT,
-			data, length, &actual, BULK_SEND_TIMEOUT);
-	return (actual == length);
+	struct usb_request *req = transfer->user_data;
+
+	req->actual = transfer->actual_length;
+	req->status = (transfer->status == LIBUSB_TRANSFER_COMPLETED) ?
+			USB_REQUEST_DONE : USB_REQUEST_FAILED;
+	if (req->status == USB_REQUEST_FAILED && debug)
+		printf("USB transfer on endpoint 0x%02x failed: status %d, "
+			"%d of %d bytes\n", req->endpoint, transfer->status,
+			req->actual, req->length);
+
+	usb.pool[usb.free_transfers++] = transfer;
+	usb.pending--;
+
+	if (req->callback)
+		req->callback(req);
+
+	/* a transfer became available, submit the next request */
+	usb_pump();
 }
 
-int get_response(libusb_device_handle *dev, void *data, int length)
+static void usb_pump(void)
+{
+	while (usb.head && usb.free_transfers) {
+		struct usb_request *req = usb.head;
+		struct libusb_transfer *transfer =
+				usb.pool[--usb.free_transfers];
+
+		usb.head = req->next;
+		if (!usb.head)
+			usb.tail = NULL;
+		req->next = NULL;
+
+		libusb_fill_bulk_transfer(transfer, usb.dev, req->endpoint,
+				req->buffer, req->length, usb_transfer_cb,
+				req, req->timeout ? req->timeout : BULK_SEND_TIMEOUT);
+
+		req->status = USB_REQUEST_SUBMITTED;
+		if (libusb_submit_transfer(transfer) < 0) {
+			usb.pool[usb.free_transfers++] = transfer;
+			usb.pending--;
+			req->actual = 0;
+			req->status = USB_REQUEST_FAILED;
+			if (req->callback)
+				req->callback(req);
+		}
+	}
+}
+
+/*
+ * Every transfer is submitted with a timeout, so waiting for events
+ * always terminates even if handling them failed once.
+ */
+static void usb_handle_events(void)
+{
+	int ret = libusb_handle_events(usb.ctx);
+
+	if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED && debug)
+		printf("USB event handling failed: %s\n",
+				libusb_error_name(ret));
+}
+
+/**
+ * usb_init: set up the asynchronous transfer engine
+ * @param ctx: libusb context the device was opened with
+ * @param dev: claimed EM100Pro device handle
+ *
+ * A previously initialized engine is shut down first.
+ */
+int usb_init(libusb_context *ctx, libusb_device_handle *dev)
 {
-	int actual;
-	libusb_bulk_transfer(dev, 2 | LIBUSB_ENDPOINT_IN,
-			data, length, &actual, BULK_SEND_TIMEOUT);
-	return actual;
+	int i;
+
+	usb_exit();
+
+	for (i = 0; i < USB_MAX_INFLIGHT; i++) {
+		usb.pool[i] = libusb_alloc_transfer(0);
+		if (!usb.pool[i]) {
+			printf("Could not allocate USB transfers.\n");
+			usb.free_transfers = i;
+			usb_exit();
+			return 0;
+		}
+	}
+	usb.free_transfers = USB_MAX_INFLIGHT;
+	usb.ctx = ctx;
+	usb.dev = dev;
+
+	return 1;
 }
 
+/**
+ * usb_exit: wait for all outstanding requests and free the engine
+ */
+void usb_exit(void)
+{
+	int i;
+
+	if (usb.dev)
+		usb_flush();
+
+	for (i = 0; i < usb.free_transfers; i++)
+		libusb_free_transfer(usb.pool[i]);
+
+	memset(&usb, 0, sizeof(usb));
+}
+
+/**
+ * usb_submit: queue an asynchronous bulk transfer
+ * @param req: request with endpoint, buffer, length and optional callback
+ *
+ * The request and its buffer must stay valid until it has completed.
+ * The callback, if any, runs from within the event handling of a later
+ * usb_wait(), usb_flush(), send_cmd() or get_response() call.
+ */
+int usb_submit(struct usb_request *req)
+{
+	if (!usb.dev) {
+		printf("USB engine not initialized.\n");
+		return 0;
+	}
+
+	req->actual = 0;
+	req->status = USB_REQUEST_QUEUED;
+	req->next = NULL;
 
+	if (usb.tail)
+		usb.tail->next = req;
+	else
+		usb.head = req;
+	usb.tail = req;
+	usb.pending++;
+
+	usb_pump();
+
+	return req->status != USB_REQUEST_FAILED;
+}
+
+/**
+ * usb_wait: handle USB events until a request has completed
+ * @param req: previously submitted request
+ *
+ * Returns 1 if the request completed successfully.
+ */
+int usb_wait(struct usb_request *req)
+{
+	while (req->status == USB_REQUEST_QUEUED ||
+			req->status == USB_REQUEST_SUBMITTED)
+		usb_handle_events();
+
+	return req->status == USB_REQUEST_DONE;
+}
+
+/**
+ * usb_flush: handle USB events until all requests have completed
+ */
+void usb_flush(void)
+{
+	while (usb.pending)
+		usb_handle_events();
+}
+
+static void send_cmd_cb(struct usb_request *req)
+{
+	if (req->status != USB_REQUEST_DONE || req->actual != req->length) {
+		printf("USB command 0x%02x failed.\n", req->buffer[0]);
+		usb.errors++;
+	}
+}
+
+/**
+ * send_cmd: queue a command
+ * @param dev: unused, the engine talks to the device from usb_init()
+ * @param data: USB_CMD_LENGTH bytes of command
+ *
+ * Returns 0 if the command could not be queued. Whether it reached the
+ * device is only known after send_cmd_flush() or a get_response().
+ */
+int send_cmd(libusb_device_handle *dev __unused, void *data)
+{
+	struct usb_request *req = &usb.cmd[usb.cmd_next];
+
+	usb.cmd_next = (usb.cmd_next + 1) % USB_CMD_SLOTS;
+
+	/* Recycle the oldest command slot */
+	if (req->status == USB_REQUEST_QUEUED ||
+			req->status == USB_REQUEST_SUBMITTED)
+		usb_wait(req);
+
+	memcpy(usb.cmd_data[req - usb.cmd], data, USB_CMD_LENGTH);
+	req->endpoint = 1 | LIBUSB_ENDPOINT_OUT;
+	req->buffer = usb.cmd_data[req - usb.cmd];
+	req->length = USB_CMD_LENGTH;
+	req->callback = send_cmd_cb;
+	req->priv = NULL;
+
+	if (!usb_submit(req))
+		return 0;
+
+	/*
+	 * Make sure the command is in flight before returning, so that
+	 * synchronous transfers issued by the caller can't overtake it.
+	 */
+	while (req->status == USB_REQUEST_QUEUED)
+		usb_handle_events();
+
+	return 1;
+}
+
+/**
+ * send_cmd_flush: wait until all queued commands have completed
+ *
+ * Returns the number of commands that failed since the last call.
+ */
+int send_cmd_flush(void)
+{
+	int errors;
+
+	usb_flush();
+	errors = usb.errors;
+	usb.errors = 0;
+	return errors;
+}
+
+/**
+ * get_response_timeout: read a response from the device
+ * @param timeout: ms to wait for it, 0 for BULK_SEND_TIMEOUT
+ *
+ * Returns the number of bytes received.
+ */
+int get_response_timeout(libusb_device_handle *dev __unused, void *data,
+		int length, unsigned int timeout)
+{
+	struct usb_request req;
+
+	memset(&req, 0, sizeof(req));
+	req.endpoint = 2 | LIBUSB_ENDPOINT_IN;
+	req.buffer = data;
+	req.length = length;
+	req.timeout = timeout;
+
+	if (!usb_submit(&req))
+		return 0;
+	usb_wait(&req);
+
+	return req.actual;
+}
+
+int get_response(libusb_device_handle *dev, void *data, int length)
+{
+	return get_response_timeout(dev, data, length, 0);
+}